@@ -0,0 +1,296 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#define NOMINMAX
+#include <windows.h>
+#undef NOMINMAX
+
+#include "processor.h"
+
+// -record files: captured packets exactly as WASAPI returned them, so -replay
+// and the benchmark can run production input through the processor again.
+//
+// A CaptureFileHeader, then records, each a CaptureRecordHeader followed by
+// size bytes of payload padded to 8 bytes. Every record starts 8-aligned, so a
+// mapped file is read in place. A Format record (payload CaptureFormatRecord)
+// comes first and again after every reconnect; each Packet record carries
+// frameCount frames in that format, or none when flags has
+// AUDCLNT_BUFFERFLAGS_SILENT. A recording cut short ends at its last whole
+// record.
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct CaptureRecordHeader
+{
+    uint32_t kind;
+    uint32_t size;
+    uint64_t devicePosition;
+    uint64_t qpcPosition; // 100 ns units, as from GetBuffer
+    uint64_t gapFrames;
+    uint32_t flags;
+    uint32_t frameCount;
+};
+
+struct CaptureFormatRecord
+{
+    uint32_t sampleType;
+    uint32_t channelCount;
+    uint32_t bytesPerFrame;
+    uint32_t sampleRate;
+    uint32_t channelMask;
+    uint32_t reserved;
+};
+#pragma pack(pop)
+
+constexpr uint32_t CAPTURE_FILE_MAGIC = 0x43414447; // "GDAC"
+constexpr uint32_t CAPTURE_FILE_VERSION = 1;
+constexpr size_t CAPTURE_RECORD_ALIGNMENT = 8;
+
+enum class CaptureRecordKind : uint32_t
+{
+    Format = 1,
+    Packet = 2
+};
+
+// Appends records through a buffered stream; never touched by two threads.
+class CaptureFileWriter
+{
+public:
+    explicit CaptureFileWriter(const std::string &path) : file(path, std::ios::binary | std::ios::trunc)
+    {
+        if (!file)
+        {
+            throw std::runtime_error("Failed to create capture file.");
+        }
+
+        CaptureFileHeader header{CAPTURE_FILE_MAGIC, CAPTURE_FILE_VERSION};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        Check();
+    }
+
+    void WriteFormat(const StreamFormat &streamFormat)
+    {
+        CaptureFormatRecord format{};
+        format.sampleType = static_cast<uint32_t>(streamFormat.sampleType);
+        format.channelCount = static_cast<uint32_t>(streamFormat.channelCount);
+        format.bytesPerFrame = static_cast<uint32_t>(streamFormat.bytesPerFrame);
+        format.sampleRate = streamFormat.sampleRate;
+        format.channelMask = streamFormat.channelMask;
+
+        CaptureRecordHeader header{};
+        header.kind = static_cast<uint32_t>(CaptureRecordKind::Format);
+        WriteRecord(header, &format, sizeof(format));
+        bytesPerFrame = streamFormat.bytesPerFrame;
+    }
+
+    void WritePacket(const CapturedPacket &packet)
+    {
+        CaptureRecordHeader header{};
+        header.kind = static_cast<uint32_t>(CaptureRecordKind::Packet);
+        header.devicePosition = packet.devicePosition;
+        header.qpcPosition = packet.qpcPosition;
+        header.gapFrames = packet.gapFrames;
+        header.flags = packet.flags;
+        header.frameCount = packet.frameCount;
+
+        // A silent buffer's contents are undefined, so none are kept.
+        size_t size = packet.flags & AUDCLNT_BUFFERFLAGS_SILENT ? 0 : static_cast<size_t>(packet.frameCount) * bytesPerFrame;
+        WriteRecord(header, packet.data.data(), size);
+    }
+
+private:
+    void WriteRecord(CaptureRecordHeader &header, const void *payload, size_t size)
+    {
+        static constexpr char padding[CAPTURE_RECORD_ALIGNMENT] = {};
+        header.size = static_cast<uint32_t>(size);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(static_cast<const char *>(payload), size);
+        file.write(padding, (CAPTURE_RECORD_ALIGNMENT - size % CAPTURE_RECORD_ALIGNMENT) % CAPTURE_RECORD_ALIGNMENT);
+        Check();
+    }
+
+    void Check()
+    {
+        if (!file)
+        {
+            throw std::runtime_error("Failed to write capture file.");
+        }
+    }
+
+    std::ofstream file;
+    int bytesPerFrame = 0;
+};
+
+static_assert(sizeof(CaptureFileHeader) % CAPTURE_RECORD_ALIGNMENT == 0 && sizeof(CaptureRecordHeader) % CAPTURE_RECORD_ALIGNMENT == 0,
+              "Capture records must stay 8-aligned.");
+
+// Maps a -record file and walks its records in place.
+class CaptureFileReader
+{
+public:
+    struct Record
+    {
+        CaptureRecordKind kind;
+        CaptureRecordHeader header;
+        StreamFormat format; // for Format records
+        const BYTE *data;    // for Packet records, header.size bytes
+    };
+
+    explicit CaptureFileReader(const std::string &path)
+    {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            throw std::runtime_error("Failed to open capture file.");
+        }
+
+        LARGE_INTEGER fileSize{};
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(CaptureFileHeader)))
+        {
+            CloseHandle(file);
+            throw std::runtime_error("Capture file is empty or unreadable.");
+        }
+        size = static_cast<size_t>(fileSize.QuadPart);
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        view = mapping ? static_cast<const BYTE *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (!view)
+        {
+            if (mapping)
+                CloseHandle(mapping);
+            CloseHandle(file);
+            throw std::runtime_error("Failed to map capture file.");
+        }
+
+        try
+        {
+            Validate();
+        }
+        catch (...)
+        {
+            Close();
+            throw;
+        }
+        Rewind();
+    }
+
+    CaptureFileReader(const CaptureFileReader &) = delete;
+    CaptureFileReader &operator=(const CaptureFileReader &) = delete;
+
+    ~CaptureFileReader() { Close(); }
+
+    // The most frames any packet holds, to size the processor for.
+    auto GetMaxPacketFrames() const -> UINT32 { return maxPacketFrames; }
+
+    auto GetPacketCount() const -> uint64_t { return packetCount; }
+
+    void Rewind() { cursor = sizeof(CaptureFileHeader); }
+
+    auto Next(Record &record) -> bool
+    {
+        if (cursor >= end)
+            return false;
+
+        std::memcpy(&record.header, view + cursor, sizeof(record.header));
+        record.kind = static_cast<CaptureRecordKind>(record.header.kind);
+        record.data = view + cursor + sizeof(record.header);
+        if (record.kind == CaptureRecordKind::Format)
+            record.format = ReadFormat(record.data);
+        cursor += RecordSize(record.header);
+        return true;
+    }
+
+private:
+    static auto RecordSize(const CaptureRecordHeader &header) -> size_t
+    {
+        return sizeof(header) + (static_cast<size_t>(header.size) + CAPTURE_RECORD_ALIGNMENT - 1) / CAPTURE_RECORD_ALIGNMENT * CAPTURE_RECORD_ALIGNMENT;
+    }
+
+    static auto ReadFormat(const BYTE *data) -> StreamFormat
+    {
+        CaptureFormatRecord format;
+        std::memcpy(&format, data, sizeof(format));
+
+        StreamFormat streamFormat;
+        streamFormat.sampleType = static_cast<SampleType>(format.sampleType);
+        streamFormat.channelCount = static_cast<int>(format.channelCount);
+        streamFormat.bytesPerFrame = static_cast<int>(format.bytesPerFrame);
+        streamFormat.sampleRate = format.sampleRate;
+        streamFormat.channelMask = format.channelMask;
+        return streamFormat;
+    }
+
+    // Checks every record once, so Next can trust them, and ends the file at
+    // the last whole one.
+    void Validate()
+    {
+        CaptureFileHeader header;
+        std::memcpy(&header, view, sizeof(header));
+        if (header.magic != CAPTURE_FILE_MAGIC || header.version != CAPTURE_FILE_VERSION)
+        {
+            throw std::runtime_error("Not a capture file, or from another version.");
+        }
+
+        size_t position = sizeof(header);
+        int bytesPerFrame = 0;
+        while (position + sizeof(CaptureRecordHeader) <= size)
+        {
+            CaptureRecordHeader record;
+            std::memcpy(&record, view + position, sizeof(record));
+            if (position + RecordSize(record) > size)
+                break;
+
+            if (record.kind == static_cast<uint32_t>(CaptureRecordKind::Format))
+            {
+                if (record.size != sizeof(CaptureFormatRecord))
+                    throw std::runtime_error("Capture file has a malformed format record.");
+                StreamFormat format = ReadFormat(view + position + sizeof(record));
+                static constexpr int SAMPLE_BYTES[] = {4, 2, 3, 4}; // by SampleType
+                if (format.sampleType > SampleType::Int32 || format.channelCount <= 0 || format.sampleRate == 0 ||
+                    format.bytesPerFrame != format.channelCount * SAMPLE_BYTES[static_cast<size_t>(format.sampleType)])
+                    throw std::runtime_error("Capture file has an unsupported format.");
+                bytesPerFrame = format.bytesPerFrame;
+            }
+            else if (record.kind == static_cast<uint32_t>(CaptureRecordKind::Packet))
+            {
+                const bool silent = record.flags & AUDCLNT_BUFFERFLAGS_SILENT;
+                if (bytesPerFrame == 0 || record.size != (silent ? 0 : static_cast<uint64_t>(record.frameCount) * bytesPerFrame))
+                    throw std::runtime_error("Capture file has a malformed packet record.");
+                maxPacketFrames = std::max(maxPacketFrames, record.frameCount);
+                ++packetCount;
+            }
+            else
+            {
+                throw std::runtime_error("Capture file has an unknown record.");
+            }
+            position += RecordSize(record);
+        }
+        end = position;
+    }
+
+    void Close()
+    {
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        CloseHandle(file);
+    }
+
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const BYTE *view = nullptr;
+    size_t size = 0;
+    size_t end = 0;
+    size_t cursor = 0;
+    UINT32 maxPacketFrames = 0;
+    uint64_t packetCount = 0;
+};
@@ -0,0 +1,454 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "dsp.h"
+
+// -format packed: samples quantized to 16 bits, predicted from the samples
+// before them and Rice coded, with several packets to a frame. Meant for
+// consumers at the other end of a network link: frames come to about a third
+// of the size of binary frames, and far less in quiet passages.
+//
+// A frame is a PackedFrameHeader, packetCount PackedPacketHeaders and then
+// payloadBytes of bit stream. All fields are little-endian and mean the same
+// as in BinaryFrameHeader; packet i has sequence number sequence + i. Bits are
+// read from the least significant bit of each byte up.
+//
+// For every packet not flagged BINARY_FLAG_SILENCE, and every channel in turn:
+//   2 bits   predictor order p, 0 to 2
+//   then blocks of up to PACKED_BLOCK_SIZE residuals, each:
+//   5 bits   Rice parameter k
+//   per residual: q zero bits and a one bit, then the low k bits, for the
+//            zigzagged residual (q << k) | low. PACKED_ESCAPE zero bits
+//            instead mean the residual follows in PACKED_RAW_BITS bits.
+// Sample q[n] = residual + prediction, the prediction being 0, q[n-1] or
+// 2q[n-1] - q[n-2] for orders 0 to 2, and the float is q[n] / 32767. The two
+// previous samples of each channel carry from packet to packet within a frame
+// and start at zero in every frame and after a silent packet. The stream is
+// padded to a whole byte at the end of the frame.
+#pragma pack(push, 1)
+struct PackedFrameHeader
+{
+    uint32_t magic;
+    uint64_t sequence;
+    uint16_t streamId;
+    uint16_t channelCount;
+    uint32_t sampleRate; // of the samples after decimation, rounded
+    uint16_t packetCount;
+    uint32_t payloadBytes;
+};
+
+struct PackedPacketHeader
+{
+    uint64_t qpcPosition;
+    uint64_t devicePosition;
+    uint16_t flags;
+    uint32_t gapFrames;
+    uint32_t frameCount;
+};
+#pragma pack(pop)
+
+constexpr uint32_t PACKED_FRAME_MAGIC = 0x50414447; // "GDAP"
+
+// Packets to a frame unless -packed-batch says otherwise.
+constexpr int PACKED_DEFAULT_BATCH = 4;
+
+constexpr int PACKED_BLOCK_SIZE = 32;
+constexpr int PACKED_PARAMETER_BITS = 5;
+constexpr int PACKED_ORDER_BITS = 2;
+constexpr uint32_t PACKED_ESCAPE = 24;
+
+// Holds any zigzagged order-2 residual of 16-bit samples.
+constexpr int PACKED_RAW_BITS = 18;
+
+constexpr double PACKED_SCALE = 32767.0;
+
+// BINARY_FLAG_SILENCE, which processor.h defines after including this file.
+constexpr uint16_t PACKED_FLAG_SILENCE = 0x8000;
+
+// Appends bits to a buffer the caller has sized for the worst case.
+class BitWriter
+{
+public:
+    void Reset(BYTE *output)
+    {
+        cursor = output;
+        accumulator = 0;
+        pending = 0;
+    }
+
+    // bits may be up to 32.
+    void Write(uint32_t value, int bits)
+    {
+        accumulator |= static_cast<uint64_t>(value) << pending;
+        pending += bits;
+        if (pending >= 32)
+        {
+            const uint32_t low = static_cast<uint32_t>(accumulator);
+            std::memcpy(cursor, &low, sizeof(low));
+            cursor += sizeof(low);
+            accumulator >>= 32;
+            pending -= 32;
+        }
+    }
+
+    // Writes out the last partial byte; returns the end of the stream.
+    auto Finish() -> BYTE *
+    {
+        for (; pending > 0; pending -= std::min(pending, 8))
+        {
+            *cursor++ = static_cast<BYTE>(accumulator);
+            accumulator >>= 8;
+        }
+        return cursor;
+    }
+
+private:
+    BYTE *cursor = nullptr;
+    uint64_t accumulator = 0;
+    int pending = 0;
+};
+
+// Reads bits in the order BitWriter writes them. Past the end it reads zero
+// bits and notes the overrun, so a truncated stream never reads out of bounds.
+class BitReader
+{
+public:
+    void Reset(const BYTE *input, size_t size)
+    {
+        cursor = input;
+        end = input + size;
+        accumulator = 0;
+        pending = 0;
+        overrun = false;
+    }
+
+    // bits may be up to 32.
+    auto Read(int bits) -> uint32_t
+    {
+        while (pending < bits)
+        {
+            uint64_t byte = 0;
+            if (cursor < end)
+                byte = *cursor++;
+            else
+                overrun = true;
+            accumulator |= byte << pending;
+            pending += 8;
+        }
+        const uint32_t value = static_cast<uint32_t>(accumulator & ((uint64_t(1) << bits) - 1));
+        accumulator >>= bits;
+        pending -= bits;
+        return value;
+    }
+
+    // Zero bits before the next one bit, which is consumed; stops without one
+    // after limit zeros.
+    auto ReadUnary(uint32_t limit) -> uint32_t
+    {
+        uint32_t zeros = 0;
+        while (zeros < limit && Read(1) == 0)
+            ++zeros;
+        return zeros;
+    }
+
+    auto Overrun() const -> bool { return overrun; }
+
+private:
+    const BYTE *cursor = nullptr;
+    const BYTE *end = nullptr;
+    uint64_t accumulator = 0;
+    int pending = 0;
+    bool overrun = false;
+};
+
+// Gathers packets into -format packed frames. Nothing allocates after
+// Configure.
+class PackedEncoder
+{
+public:
+    void Configure(int channelCount, size_t maxFrames, int batchPackets)
+    {
+        this->channelCount = channelCount;
+        this->batchPackets = batchPackets;
+
+        // An escaped residual is the longest code; blocks and orders add a
+        // few bits per channel. The packet headers go in front of the stream
+        // once their count is known.
+        const size_t blocks = (maxFrames + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+        const size_t bitsPerChannel = maxFrames * (PACKED_ESCAPE + PACKED_RAW_BITS) + blocks * PACKED_PARAMETER_BITS + PACKED_ORDER_BITS;
+        streamOffset = sizeof(PackedFrameHeader) + static_cast<size_t>(batchPackets) * sizeof(PackedPacketHeader);
+        buffer.resize(streamOffset + static_cast<size_t>(batchPackets) * channelCount * (bitsPerChannel / 8 + 1) + sizeof(uint32_t));
+        packets.reserve(batchPackets);
+        history.resize(channelCount);
+        quantized.resize(maxFrames + 2);
+        Clear();
+    }
+
+    auto IsEmpty() const -> bool { return packets.empty(); }
+
+    // Adds a packet of header.frameCount samples per channel to the frame.
+    // Returns true once the frame is full and should be finished.
+    auto Add(uint64_t sequence, const PackedPacketHeader &header, const std::vector<std::vector<Sample>> &channels) -> bool
+    {
+        AddHeader(sequence, header);
+        for (int channel = 0; channel < channelCount; ++channel)
+            EncodeChannel(channels[channel].data(), header.frameCount, history[channel]);
+        return IsFull();
+    }
+
+    // Adds a packet that stands for header.frameCount frames of silence and
+    // carries no samples; header.flags should include the silence flag.
+    auto AddSilence(uint64_t sequence, const PackedPacketHeader &header) -> bool
+    {
+        AddHeader(sequence, header);
+        for (auto &previous : history)
+            previous = {0, 0};
+        return IsFull();
+    }
+
+    // Completes the frame and starts the next one. The frame stays valid
+    // until the next Add.
+    auto Finish(uint16_t streamId, uint32_t sampleRate) -> std::pair<const BYTE *, size_t>
+    {
+        const BYTE *end = writer.Finish();
+
+        PackedFrameHeader header{};
+        header.magic = PACKED_FRAME_MAGIC;
+        header.sequence = firstSequence;
+        header.streamId = streamId;
+        header.channelCount = static_cast<uint16_t>(channelCount);
+        header.sampleRate = sampleRate;
+        header.packetCount = static_cast<uint16_t>(packets.size());
+        header.payloadBytes = static_cast<uint32_t>(end - (buffer.data() + streamOffset));
+
+        // Right up against the stream, so the frame is one contiguous run.
+        BYTE *start = buffer.data() + streamOffset - packets.size() * sizeof(PackedPacketHeader) - sizeof(header);
+        std::memcpy(start, &header, sizeof(header));
+        std::memcpy(start + sizeof(header), packets.data(), packets.size() * sizeof(PackedPacketHeader));
+
+        Clear();
+        return {start, static_cast<size_t>(end - start)};
+    }
+
+private:
+    struct History
+    {
+        int32_t last = 0;
+        int32_t beforeLast = 0;
+    };
+
+    void AddHeader(uint64_t sequence, const PackedPacketHeader &header)
+    {
+        if (packets.empty())
+            firstSequence = sequence;
+        packets.push_back(header);
+    }
+
+    auto IsFull() const -> bool { return static_cast<int>(packets.size()) >= batchPackets; }
+
+    void Clear()
+    {
+        packets.clear();
+        for (auto &previous : history)
+            previous = {0, 0};
+        writer.Reset(buffer.data() + streamOffset);
+    }
+
+    static auto ZigZag(int32_t value) -> uint32_t
+    {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+    static auto Residual(int order, const int32_t *samples, size_t i) -> int32_t
+    {
+        if (order == 0)
+            return samples[i];
+        if (order == 1)
+            return samples[i] - samples[i - 1];
+        return samples[i] - 2 * samples[i - 1] + samples[i - 2];
+    }
+
+    void EncodeChannel(const Sample *samples, size_t frameCount, History &previous)
+    {
+        // Two samples of history in front, so every order reads the same way.
+        int32_t *values = quantized.data() + 2;
+        values[-2] = previous.beforeLast;
+        values[-1] = previous.last;
+
+        // The order whose residuals are smallest in sum codes shortest.
+        uint64_t cost[3] = {0, 0, 0};
+        for (size_t i = 0; i < frameCount; ++i)
+        {
+            double scaled = std::clamp(static_cast<double>(samples[i]), -1.0, 1.0) * PACKED_SCALE;
+            values[i] = static_cast<int32_t>(std::lrint(scaled));
+            cost[0] += ZigZag(values[i]);
+            cost[1] += ZigZag(values[i] - values[i - 1]);
+            cost[2] += ZigZag(values[i] - 2 * values[i - 1] + values[i - 2]);
+        }
+        const int order = static_cast<int>(std::min_element(cost, cost + 3) - cost);
+        writer.Write(static_cast<uint32_t>(order), PACKED_ORDER_BITS);
+
+        uint32_t residuals[PACKED_BLOCK_SIZE];
+        for (size_t blockStart = 0; blockStart < frameCount; blockStart += PACKED_BLOCK_SIZE)
+        {
+            const size_t count = std::min<size_t>(PACKED_BLOCK_SIZE, frameCount - blockStart);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                residuals[i] = ZigZag(Residual(order, values, blockStart + i));
+                sum += residuals[i];
+            }
+
+            // 2^k just under the mean residual codes about as short as the
+            // best k for geometrically distributed residuals.
+            const int parameter = std::bit_width(static_cast<uint32_t>(sum / count / 2));
+            writer.Write(static_cast<uint32_t>(parameter), PACKED_PARAMETER_BITS);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const uint32_t quotient = residuals[i] >> parameter;
+                if (quotient >= PACKED_ESCAPE)
+                {
+                    writer.Write(0, PACKED_ESCAPE);
+                    writer.Write(residuals[i], PACKED_RAW_BITS);
+                    continue;
+                }
+                writer.Write(1u << quotient, quotient + 1);
+                if (parameter > 0)
+                    writer.Write(residuals[i] & ((1u << parameter) - 1), parameter);
+            }
+        }
+
+        if (frameCount >= 2)
+            previous = {values[frameCount - 1], values[frameCount - 2]};
+        else if (frameCount == 1)
+            previous = {values[0], previous.last};
+    }
+
+    int channelCount = 0;
+    int batchPackets = 1;
+    size_t streamOffset = 0;
+    uint64_t firstSequence = 0;
+    std::vector<BYTE> buffer;
+    std::vector<PackedPacketHeader> packets;
+    std::vector<History> history;
+    std::vector<int32_t> quantized;
+    BitWriter writer;
+};
+
+// Turns -format packed frames back into packets, following the layout at the
+// top of this file. A reference for consumers, and what the bench checks
+// PackedEncoder against. Buffers are kept from frame to frame.
+class PackedDecoder
+{
+public:
+    struct Packet
+    {
+        uint64_t sequence = 0;
+        PackedPacketHeader header{};
+        std::vector<std::vector<Sample>> channels; // frameCount zeros for silent packets
+    };
+
+    // Decodes the frame at the start of data. Returns its size, or 0 while
+    // data does not hold all of it yet; throws if the frame is malformed.
+    auto Decode(const BYTE *data, size_t size) -> size_t
+    {
+        if (size < sizeof(PackedFrameHeader))
+            return 0;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != PACKED_FRAME_MAGIC)
+        {
+            throw std::runtime_error("Packed frame has the wrong magic number.");
+        }
+
+        const BYTE *packetHeaders = data + sizeof(header);
+        const size_t streamOffset = sizeof(header) + static_cast<size_t>(header.packetCount) * sizeof(PackedPacketHeader);
+        if (size < streamOffset || size - streamOffset < header.payloadBytes)
+            return 0;
+
+        reader.Reset(data + streamOffset, header.payloadBytes);
+        history.assign(header.channelCount, {});
+        packets.resize(header.packetCount);
+        for (size_t i = 0; i < packets.size(); ++i)
+        {
+            Packet &packet = packets[i];
+            packet.sequence = header.sequence + i;
+            std::memcpy(&packet.header, packetHeaders + i * sizeof(PackedPacketHeader), sizeof(PackedPacketHeader));
+            packet.channels.resize(header.channelCount);
+
+            if (packet.header.flags & PACKED_FLAG_SILENCE)
+            {
+                for (auto &samples : packet.channels)
+                    samples.assign(packet.header.frameCount, 0);
+                history.assign(header.channelCount, {});
+                continue;
+            }
+            for (int channel = 0; channel < header.channelCount; ++channel)
+                DecodeChannel(packet.channels[channel], packet.header.frameCount, history[channel]);
+        }
+
+        if (reader.Overrun())
+        {
+            throw std::runtime_error("Packed frame payload ends before its last packet.");
+        }
+        return streamOffset + header.payloadBytes;
+    }
+
+    // The last decoded frame.
+    auto Header() const -> const PackedFrameHeader & { return header; }
+    auto Packets() const -> const std::vector<Packet> & { return packets; }
+
+private:
+    struct History
+    {
+        int32_t last = 0;
+        int32_t beforeLast = 0;
+    };
+
+    void DecodeChannel(std::vector<Sample> &samples, size_t frameCount, History &previous)
+    {
+        const uint32_t order = reader.Read(PACKED_ORDER_BITS);
+        if (order > 2)
+        {
+            throw std::runtime_error("Packed frame uses an unknown predictor order.");
+        }
+
+        samples.resize(frameCount);
+        int parameter = 0;
+        for (size_t i = 0; i < frameCount; ++i)
+        {
+            if (i % PACKED_BLOCK_SIZE == 0)
+                parameter = static_cast<int>(reader.Read(PACKED_PARAMETER_BITS));
+
+            const uint32_t quotient = reader.ReadUnary(PACKED_ESCAPE);
+            uint32_t zigzagged;
+            if (quotient == PACKED_ESCAPE)
+                zigzagged = reader.Read(PACKED_RAW_BITS);
+            else
+                zigzagged = (quotient << parameter) | (parameter > 0 ? reader.Read(parameter) : 0);
+            const int32_t residual = static_cast<int32_t>(zigzagged >> 1) ^ -static_cast<int32_t>(zigzagged & 1);
+
+            int32_t prediction = 0;
+            if (order == 1)
+                prediction = previous.last;
+            else if (order == 2)
+                prediction = 2 * previous.last - previous.beforeLast;
+            const int32_t value = residual + prediction;
+
+            previous = {value, previous.last};
+            samples[i] = static_cast<Sample>(value / PACKED_SCALE);
+        }
+    }
+
+    PackedFrameHeader header{};
+    std::vector<Packet> packets;
+    std::vector<History> history;
+    BitReader reader;
+};
@@ -0,0 +1,1269 @@
+﻿#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <fftw3.h>
+
+#define NOMINMAX
+#include <windows.h>
+#undef NOMINMAX
+#include <mmreg.h>
+#include <ksmedia.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// Building with GETDESKTOPAUDIO_SINGLE_PRECISION keeps samples in float from
+// WASAPI through fftwf and into the JSON output. Compressed samples then agree
+// with the double build to about 1e-6 of full scale for transforms up to 4096
+// points (float rounding grows with log2 of the transform size).
+#ifdef GETDESKTOPAUDIO_SINGLE_PRECISION
+using Sample = float;
+#pragma comment(lib, "fftw3f.lib")
+#else
+using Sample = double;
+#endif
+
+enum class StftWindow
+{
+    Hann,
+    SqrtHann
+};
+
+enum class SimdLevel
+{
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+enum class SampleType
+{
+    Float32,
+    Int16,
+    Int24,
+    Int32
+};
+
+// The negotiated mix format, reduced to what the decoder needs.
+struct StreamFormat
+{
+    SampleType sampleType = SampleType::Float32;
+    int channelCount = 2;
+    int bytesPerFrame = 8;
+    DWORD sampleRate = 48000;
+    DWORD channelMask = 0;
+
+    static auto FromWaveFormat(const WAVEFORMATEX *waveFormat) -> StreamFormat
+    {
+        StreamFormat format;
+        format.channelCount = waveFormat->nChannels;
+        format.bytesPerFrame = waveFormat->nBlockAlign;
+        format.sampleRate = waveFormat->nSamplesPerSec;
+
+        bool isFloat = waveFormat->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+        bool isPcm = waveFormat->wFormatTag == WAVE_FORMAT_PCM;
+        if (waveFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE)
+        {
+            const auto *extensible = reinterpret_cast<const WAVEFORMATEXTENSIBLE *>(waveFormat);
+            format.channelMask = extensible->dwChannelMask;
+            isFloat = IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT);
+            isPcm = IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_PCM);
+        }
+
+        // Containers are decoded by their full width, so 24-bit samples in a
+        // 32-bit container read as Int32 with the low byte zero.
+        if (isFloat && waveFormat->wBitsPerSample == 32)
+            format.sampleType = SampleType::Float32;
+        else if (isPcm && waveFormat->wBitsPerSample == 16)
+            format.sampleType = SampleType::Int16;
+        else if (isPcm && waveFormat->wBitsPerSample == 24)
+            format.sampleType = SampleType::Int24;
+        else if (isPcm && waveFormat->wBitsPerSample == 32)
+            format.sampleType = SampleType::Int32;
+        else
+            throw std::runtime_error("Unsupported mix format.");
+
+        if (format.channelCount <= 0)
+            throw std::runtime_error("Mix format has no channels.");
+
+        return format;
+    }
+};
+
+template <typename T>
+struct FFTWTraits;
+
+template <>
+struct FFTWTraits<double>
+{
+    using Complex = fftw_complex;
+    using Plan = fftw_plan;
+
+    static double *AllocReal(size_t n) { return fftw_alloc_real(n); }
+    static Complex *AllocComplex(size_t n) { return fftw_alloc_complex(n); }
+    static void Free(void *p) { fftw_free(p); }
+    static Plan PlanManyR2C(int n, int howMany, double *in, int inDistance, Complex *out, int outDistance, unsigned flags)
+    {
+        return fftw_plan_many_dft_r2c(1, &n, howMany, in, nullptr, 1, inDistance, out, nullptr, 1, outDistance, flags);
+    }
+    static Plan PlanManyC2R(int n, int howMany, Complex *in, int inDistance, double *out, int outDistance, unsigned flags)
+    {
+        return fftw_plan_many_dft_c2r(1, &n, howMany, in, nullptr, 1, inDistance, out, nullptr, 1, outDistance, flags);
+    }
+    static void ExecuteR2C(Plan plan, double *in, Complex *out) { fftw_execute_dft_r2c(plan, in, out); }
+    static void ExecuteC2R(Plan plan, Complex *in, double *out) { fftw_execute_dft_c2r(plan, in, out); }
+    static void DestroyPlan(Plan plan) { fftw_destroy_plan(plan); }
+    static bool ImportWisdom(const char *path) { return fftw_import_wisdom_from_filename(path) != 0; }
+    static bool ExportWisdom(const char *path) { return fftw_export_wisdom_to_filename(path) != 0; }
+};
+
+template <>
+struct FFTWTraits<float>
+{
+    using Complex = fftwf_complex;
+    using Plan = fftwf_plan;
+
+    static float *AllocReal(size_t n) { return fftwf_alloc_real(n); }
+    static Complex *AllocComplex(size_t n) { return fftwf_alloc_complex(n); }
+    static void Free(void *p) { fftwf_free(p); }
+    static Plan PlanManyR2C(int n, int howMany, float *in, int inDistance, Complex *out, int outDistance, unsigned flags)
+    {
+        return fftwf_plan_many_dft_r2c(1, &n, howMany, in, nullptr, 1, inDistance, out, nullptr, 1, outDistance, flags);
+    }
+    static Plan PlanManyC2R(int n, int howMany, Complex *in, int inDistance, float *out, int outDistance, unsigned flags)
+    {
+        return fftwf_plan_many_dft_c2r(1, &n, howMany, in, nullptr, 1, inDistance, out, nullptr, 1, outDistance, flags);
+    }
+    static void ExecuteR2C(Plan plan, float *in, Complex *out) { fftwf_execute_dft_r2c(plan, in, out); }
+    static void ExecuteC2R(Plan plan, Complex *in, float *out) { fftwf_execute_dft_c2r(plan, in, out); }
+    static void DestroyPlan(Plan plan) { fftwf_destroy_plan(plan); }
+    static bool ImportWisdom(const char *path) { return fftwf_import_wisdom_from_filename(path) != 0; }
+    static bool ExportWisdom(const char *path) { return fftwf_export_wisdom_to_filename(path) != 0; }
+};
+
+using FFTW = FFTWTraits<Sample>;
+
+class FFTPlanCache
+{
+public:
+    struct Plan
+    {
+        // A real transform of length N only has N/2+1 independent bins; the rest
+        // are the complex conjugates and are never computed. The plan runs
+        // channelCount transforms at once over planar buffers: channel c owns
+        // samples[c * size, ...) and spectrum[c * bins, ...). Plans carry no
+        // buffers of their own; callers execute them on an FFTWorkspace so one
+        // plan can serve several capture threads at once.
+        Plan(int size, int channelCount, unsigned flags) : size(size), channelCount(channelCount), bins(size / 2 + 1)
+        {
+            std::lock_guard<std::mutex> plannerLock(plannerMutex);
+            Sample *samples = FFTW::AllocReal(static_cast<size_t>(size) * channelCount);
+            FFTW::Complex *spectrum = FFTW::AllocComplex(static_cast<size_t>(bins) * channelCount);
+            if (samples && spectrum)
+            {
+                forward = FFTW::PlanManyR2C(size, channelCount, samples, size, spectrum, bins, flags);
+                inverse = FFTW::PlanManyC2R(size, channelCount, spectrum, bins, samples, size, flags);
+            }
+            FFTW::Free(samples);
+            FFTW::Free(spectrum);
+
+            if (!forward || !inverse)
+            {
+                Release();
+                throw std::runtime_error("Failed to create FFT plan.");
+            }
+        }
+
+        // Destroying a plan goes through the planner too, so it is serialized
+        // with planning and wisdom in every other cache.
+        ~Plan()
+        {
+            std::lock_guard<std::mutex> plannerLock(plannerMutex);
+            Release();
+        }
+
+        Plan(const Plan &) = delete;
+        Plan &operator=(const Plan &) = delete;
+
+        int size;
+        int channelCount;
+        int bins;
+        FFTW::Plan forward = nullptr;
+        FFTW::Plan inverse = nullptr;
+
+    private:
+        // Callers hold plannerMutex.
+        void Release()
+        {
+            if (forward)
+                FFTW::DestroyPlan(forward);
+            if (inverse)
+                FFTW::DestroyPlan(inverse);
+        }
+    };
+
+    explicit FFTPlanCache(unsigned flags = FFTW_ESTIMATE) : flags(flags) {}
+
+    // Plans are created on first use; call this up front for the sizes known at
+    // startup so FFTW_MEASURE/FFTW_PATIENT planning never happens mid-stream.
+    // Safe to call from several threads; the FFTW planner itself is not, so
+    // planning is serialized across every cache.
+    auto Get(int size, int channelCount = 1) -> Plan &
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t key = static_cast<uint64_t>(channelCount) << 32 | static_cast<uint32_t>(size);
+        auto it = plans.find(key);
+        if (it == plans.end())
+            it = plans.emplace(key, std::make_unique<Plan>(size, channelCount, flags)).first;
+        return *it->second;
+    }
+
+    // Wisdom is what FFTW learned from measuring plans. Loaded before the
+    // first plan, it turns FFTW_MEASURE/FFTW_PATIENT planning of a known size
+    // into a lookup. Double and single precision builds keep separate wisdom.
+    static auto ImportWisdom(const std::string &path) -> bool
+    {
+        std::lock_guard<std::mutex> plannerLock(plannerMutex);
+        return FFTW::ImportWisdom(path.c_str());
+    }
+
+    static auto ExportWisdom(const std::string &path) -> bool
+    {
+        std::lock_guard<std::mutex> plannerLock(plannerMutex);
+        return FFTW::ExportWisdom(path.c_str());
+    }
+
+private:
+    static inline std::mutex plannerMutex;
+
+    unsigned flags;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::unique_ptr<Plan>> plans;
+};
+
+// Aligned per-stream buffers that cached plans execute on.
+class FFTWorkspace
+{
+public:
+    FFTWorkspace(int maxSize, int channelCount)
+    {
+        samples = FFTW::AllocReal(static_cast<size_t>(maxSize) * channelCount);
+        spectrum = FFTW::AllocComplex(static_cast<size_t>(maxSize / 2 + 1) * channelCount);
+        if (!samples || !spectrum)
+        {
+            FFTW::Free(samples);
+            FFTW::Free(spectrum);
+            throw std::runtime_error("Failed to allocate FFT buffers.");
+        }
+    }
+
+    ~FFTWorkspace()
+    {
+        FFTW::Free(samples);
+        FFTW::Free(spectrum);
+    }
+
+    FFTWorkspace(const FFTWorkspace &) = delete;
+    FFTWorkspace &operator=(const FFTWorkspace &) = delete;
+
+    Sample *samples = nullptr;
+    FFTW::Complex *spectrum = nullptr;
+};
+
+// Windows and overlap-add gain shared by every channel of one STFT stage.
+struct StftConfig
+{
+    StftConfig(int frameSize, int hop, StftWindow window) : frameSize(frameSize), hop(hop)
+    {
+        if (frameSize < 2 || (frameSize & (frameSize - 1)) != 0)
+            throw std::invalid_argument("STFT frame size must be a power of two.");
+        if (hop <= 0 || hop > frameSize || frameSize % hop != 0)
+            throw std::invalid_argument("STFT hop must divide the frame size.");
+
+        // Periodic Hann, so shifted copies at hop = N/2, N/4, ... sum to a constant.
+        analysis.resize(frameSize);
+        synthesis.resize(frameSize);
+        for (int i = 0; i < frameSize; ++i)
+        {
+            double hann = 0.5 - 0.5 * std::cos(2.0 * 3.14159265358979323846 * i / frameSize);
+            if (window == StftWindow::SqrtHann)
+            {
+                analysis[i] = static_cast<Sample>(std::sqrt(hann));
+                synthesis[i] = analysis[i];
+            }
+            else
+            {
+                analysis[i] = static_cast<Sample>(hann);
+                synthesis[i] = 1;
+            }
+        }
+
+        // Each emitted sample is the sum of frameSize / hop overlapping frames.
+        normalization.resize(hop);
+        for (int i = 0; i < hop; ++i)
+        {
+            double sum = 0.0;
+            for (int offset = i; offset < frameSize; offset += hop)
+                sum += static_cast<double>(analysis[offset]) * synthesis[offset];
+            if (sum < 1e-6)
+                throw std::invalid_argument("STFT window and hop do not overlap-add.");
+            normalization[i] = static_cast<Sample>(1.0 / sum);
+        }
+    }
+
+    int frameSize;
+    int hop;
+    std::vector<Sample> analysis;
+    std::vector<Sample> synthesis;
+    std::vector<Sample> normalization;
+};
+
+// Streaming short-time transform over every channel of a stream. Each input
+// sample produces one output sample, delayed by frameSize; history carries
+// across calls so packet boundaries have no effect on the result. Frames of
+// all channels are handed over together so they can share one batched FFT.
+class StftProcessor
+{
+public:
+    StftProcessor(const StftConfig &config, int channelCount)
+        : config(&config), channelCount(channelCount)
+    {
+        const size_t frameSize = config.frameSize;
+        history.resize(frameSize * channelCount);
+        overlap.resize(frameSize * channelCount);
+        ready.resize(static_cast<size_t>(config.hop) * channelCount);
+        frames.resize(frameSize * channelCount);
+    }
+
+    // Returns to the state after a long run of zeros, so skipped silence can
+    // resume without replaying it.
+    void Reset()
+    {
+        std::fill(history.begin(), history.end(), Sample(0));
+        std::fill(overlap.begin(), overlap.end(), Sample(0));
+        std::fill(ready.begin(), ready.end(), Sample(0));
+        filled = 0;
+    }
+
+    // Processes count samples of every channel in place. transformFrames
+    // receives channelCount windowed frames laid out back to back and must
+    // replace them with the processed, normalized frames.
+    template <typename TransformFn>
+    void Process(Sample *const *channels, size_t count, TransformFn &&transformFrames)
+    {
+        const size_t frameSize = config->frameSize;
+        const size_t hop = config->hop;
+
+        size_t done = 0;
+        while (done < count)
+        {
+            size_t take = std::min(hop - filled, count - done);
+            for (int channel = 0; channel < channelCount; ++channel)
+            {
+                Sample *samples = channels[channel] + done;
+                std::copy(samples, samples + take, history.begin() + channel * frameSize + (frameSize - hop + filled));
+                std::copy(ready.begin() + channel * hop + filled, ready.begin() + channel * hop + filled + take, samples);
+            }
+            filled += take;
+            done += take;
+
+            if (filled == hop)
+            {
+                ProcessFrames(transformFrames);
+                filled = 0;
+            }
+        }
+    }
+
+private:
+    template <typename TransformFn>
+    void ProcessFrames(TransformFn &transformFrames)
+    {
+        const size_t frameSize = config->frameSize;
+        const size_t hop = config->hop;
+
+        for (int channel = 0; channel < channelCount; ++channel)
+        {
+            const Sample *channelHistory = history.data() + channel * frameSize;
+            Sample *frame = frames.data() + channel * frameSize;
+            for (size_t i = 0; i < frameSize; ++i)
+                frame[i] = channelHistory[i] * config->analysis[i];
+        }
+
+        transformFrames(frames.data());
+
+        for (int channel = 0; channel < channelCount; ++channel)
+        {
+            const Sample *frame = frames.data() + channel * frameSize;
+            Sample *channelOverlap = overlap.data() + channel * frameSize;
+            Sample *channelReady = ready.data() + channel * hop;
+            Sample *channelHistory = history.data() + channel * frameSize;
+
+            for (size_t i = 0; i < frameSize; ++i)
+                channelOverlap[i] += frame[i] * config->synthesis[i];
+
+            for (size_t i = 0; i < hop; ++i)
+                channelReady[i] = channelOverlap[i] * config->normalization[i];
+
+            std::copy(channelOverlap + hop, channelOverlap + frameSize, channelOverlap);
+            std::fill(channelOverlap + frameSize - hop, channelOverlap + frameSize, Sample(0));
+            std::copy(channelHistory + hop, channelHistory + frameSize, channelHistory);
+        }
+    }
+
+    const StftConfig *config;
+    int channelCount;
+    std::vector<Sample> history;
+    std::vector<Sample> overlap;
+    std::vector<Sample> ready;
+    std::vector<Sample> frames;
+    size_t filled = 0;
+};
+
+template <SampleType Type>
+inline Sample DecodeSample(const BYTE *data);
+
+template <>
+inline Sample DecodeSample<SampleType::Float32>(const BYTE *data)
+{
+    float value;
+    std::memcpy(&value, data, sizeof(value));
+    return static_cast<Sample>(value);
+}
+
+template <>
+inline Sample DecodeSample<SampleType::Int16>(const BYTE *data)
+{
+    int16_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return static_cast<Sample>(value) * static_cast<Sample>(1.0 / 32768.0);
+}
+
+template <>
+inline Sample DecodeSample<SampleType::Int24>(const BYTE *data)
+{
+    uint32_t bits = static_cast<uint32_t>(data[0]) << 8 | static_cast<uint32_t>(data[1]) << 16 | static_cast<uint32_t>(data[2]) << 24;
+    int32_t value = static_cast<int32_t>(bits) >> 8;
+    return static_cast<Sample>(value) * static_cast<Sample>(1.0 / 8388608.0);
+}
+
+template <>
+inline Sample DecodeSample<SampleType::Int32>(const BYTE *data)
+{
+    int32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return static_cast<Sample>(value) * static_cast<Sample>(1.0 / 2147483648.0);
+}
+
+template <SampleType Type>
+constexpr size_t SAMPLE_BYTES = Type == SampleType::Int16 ? 2 : Type == SampleType::Int24 ? 3 : 4;
+
+// Splits interleaved frames into one buffer per channel and returns the peak
+// magnitude seen. Channels > 0 fixes the stride at compile time so the inner
+// loop unrolls; Channels == 0 is the fallback for layouts without a
+// specialization.
+template <SampleType Type, int Channels>
+Sample DeinterleaveFrames(const BYTE *data, size_t frameCount, int channelCount, Sample *const *planar)
+{
+    constexpr size_t sampleBytes = SAMPLE_BYTES<Type>;
+    const int channels = Channels > 0 ? Channels : channelCount;
+    const size_t frameBytes = sampleBytes * channels;
+
+    Sample peak = 0;
+    for (size_t frame = 0; frame < frameCount; ++frame)
+    {
+        const BYTE *frameData = data + frame * frameBytes;
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            Sample value = DecodeSample<Type>(frameData + channel * sampleBytes);
+            planar[channel][frame] = value;
+            peak = std::max(peak, std::abs(value));
+        }
+    }
+    return peak;
+}
+
+using DeinterleaveFn = Sample (*)(const BYTE *, size_t, int, Sample *const *);
+
+inline auto DetectSimdLevel() -> SimdLevel
+{
+#if defined(_M_X64) || defined(_M_IX86)
+    int info[4] = {};
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+
+    // AVX2 also needs the OS to save the upper YMM state across switches.
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+    {
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 5)) != 0)
+            return SimdLevel::Avx2;
+    }
+
+    return sse2 ? SimdLevel::Sse2 : SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+template <typename T>
+float DeinterleaveStereoScalar(const float *input, size_t frameCount, T *left, T *right)
+{
+    float peak = 0.0f;
+    for (size_t i = 0; i < frameCount; ++i)
+    {
+        left[i] = input[i * 2];
+        right[i] = input[i * 2 + 1];
+        peak = std::max(peak, std::max(std::abs(input[i * 2]), std::abs(input[i * 2 + 1])));
+    }
+    return peak;
+}
+
+// The compressor maps a bin of magnitude m above its threshold t to
+// t + (m - t) / ratio, a gain of 1/ratio + (1 - 1/ratio) / sqrt(x) for
+// x = m^2 / t^2. The gain depends on t only through x, so one table serves
+// every band: it is indexed by the float bits of x, GAIN_TABLE_MANTISSA_BITS of
+// mantissa per octave, with entry 0 for x <= 1 (gain 1) and the last entry
+// standing in for everything past GAIN_TABLE_OCTAVES octaves of x. Eight bits
+// keep table gains within 0.1% of the curve at any ratio.
+constexpr int GAIN_TABLE_MANTISSA_BITS = 8;
+constexpr int GAIN_TABLE_OCTAVES = 48;
+constexpr int GAIN_TABLE_SHIFT = 23 - GAIN_TABLE_MANTISSA_BITS;
+constexpr int GAIN_TABLE_SIZE = (GAIN_TABLE_OCTAVES << GAIN_TABLE_MANTISSA_BITS) + 2;
+constexpr int32_t GAIN_TABLE_ONE_BITS = 0x3F800000; // 1.0f
+
+inline auto GainTableIndex(float normalized) -> int
+{
+    int32_t bits;
+    std::memcpy(&bits, &normalized, sizeof(bits));
+    return std::clamp(((bits - GAIN_TABLE_ONE_BITS) >> GAIN_TABLE_SHIFT) + 1, 0, GAIN_TABLE_SIZE - 1);
+}
+
+// Each entry holds the gain at the middle of its bucket.
+inline auto BuildGainTable(double ratio) -> std::vector<float>
+{
+    std::vector<float> table(GAIN_TABLE_SIZE);
+    table[0] = 1.0f;
+    for (int i = 1; i < GAIN_TABLE_SIZE; ++i)
+    {
+        int32_t bits = GAIN_TABLE_ONE_BITS + ((i - 1) << GAIN_TABLE_SHIFT) + (1 << (GAIN_TABLE_SHIFT - 1));
+        float normalized;
+        std::memcpy(&normalized, &bits, sizeof(normalized));
+        table[i] = static_cast<float>(1.0 / ratio + (1.0 - 1.0 / ratio) / std::sqrt(static_cast<double>(normalized)));
+    }
+    return table;
+}
+
+// Writes the table gain of each of binCount interleaved (re, im) bins to
+// gains; inverseThresholds holds 1/t^2 per bin.
+template <typename T>
+void GainLookupScalar(const T *bins, size_t binCount, const float *inverseThresholds, const float *table, T *gains)
+{
+    for (size_t i = 0; i < binCount; ++i)
+    {
+        T squared = bins[i * 2] * bins[i * 2] + bins[i * 2 + 1] * bins[i * 2 + 1];
+        gains[i] = table[GainTableIndex(static_cast<float>(squared) * inverseThresholds[i])];
+    }
+}
+
+// Dot product of count samples with count FIR taps.
+template <typename T>
+T FirDotScalar(const T *samples, const T *taps, size_t count)
+{
+    T sum = 0;
+    for (size_t i = 0; i < count; ++i)
+        sum += samples[i] * taps[i];
+    return sum;
+}
+
+#if defined(_M_X64) || defined(_M_IX86)
+// The deinterleave kernels fold |sample| into a running peak as they go.
+
+inline __m128 AbsPs(__m128 value)
+{
+    return _mm_and_ps(value, _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)));
+}
+
+inline float HorizontalMax(__m128 value)
+{
+    value = _mm_max_ps(value, _mm_movehl_ps(value, value));
+    value = _mm_max_ss(value, _mm_shuffle_ps(value, value, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(value);
+}
+
+inline float HorizontalMax(__m256 value)
+{
+    return HorizontalMax(_mm_max_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1)));
+}
+
+inline float DeinterleaveStereoSse2(const float *input, size_t frameCount, double *left, double *right)
+{
+    __m128 peak = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 2 <= frameCount; i += 2)
+    {
+        __m128 frames = _mm_loadu_ps(input + i * 2);
+        peak = _mm_max_ps(peak, AbsPs(frames));
+        __m128 split = _mm_shuffle_ps(frames, frames, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_pd(left + i, _mm_cvtps_pd(split));
+        _mm_storeu_pd(right + i, _mm_cvtps_pd(_mm_movehl_ps(split, split)));
+    }
+    float tail = DeinterleaveStereoScalar(input + i * 2, frameCount - i, left + i, right + i);
+    return std::max(HorizontalMax(peak), tail);
+}
+
+inline float DeinterleaveStereoSse2(const float *input, size_t frameCount, float *left, float *right)
+{
+    __m128 peak = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= frameCount; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(input + i * 2);
+        __m128 b = _mm_loadu_ps(input + i * 2 + 4);
+        peak = _mm_max_ps(peak, _mm_max_ps(AbsPs(a), AbsPs(b)));
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    float tail = DeinterleaveStereoScalar(input + i * 2, frameCount - i, left + i, right + i);
+    return std::max(HorizontalMax(peak), tail);
+}
+
+inline float DeinterleaveStereoAvx2(const float *input, size_t frameCount, double *left, double *right)
+{
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 peak = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= frameCount; i += 4)
+    {
+        __m256 frames = _mm256_permutevar8x32_ps(_mm256_loadu_ps(input + i * 2), split);
+        peak = _mm256_max_ps(peak, _mm256_and_ps(frames, absMask));
+        _mm256_storeu_pd(left + i, _mm256_cvtps_pd(_mm256_castps256_ps128(frames)));
+        _mm256_storeu_pd(right + i, _mm256_cvtps_pd(_mm256_extractf128_ps(frames, 1)));
+    }
+    float tail = DeinterleaveStereoScalar(input + i * 2, frameCount - i, left + i, right + i);
+    return std::max(HorizontalMax(peak), tail);
+}
+
+inline float DeinterleaveStereoAvx2(const float *input, size_t frameCount, float *left, float *right)
+{
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 peak = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= frameCount; i += 8)
+    {
+        __m256 a = _mm256_permutevar8x32_ps(_mm256_loadu_ps(input + i * 2), split);
+        __m256 b = _mm256_permutevar8x32_ps(_mm256_loadu_ps(input + i * 2 + 8), split);
+        peak = _mm256_max_ps(peak, _mm256_max_ps(_mm256_and_ps(a, absMask), _mm256_and_ps(b, absMask)));
+        _mm256_storeu_ps(left + i, _mm256_permute2f128_ps(a, b, 0x20));
+        _mm256_storeu_ps(right + i, _mm256_permute2f128_ps(a, b, 0x31));
+    }
+    float tail = DeinterleaveStereoScalar(input + i * 2, frameCount - i, left + i, right + i);
+    return std::max(HorizontalMax(peak), tail);
+}
+
+// The vector lookups compute four or eight table indices at once; SSE2 has no
+// gather, so it loads the entries one by one.
+inline __m128i GainTableIndices(__m128 normalized)
+{
+    __m128i index = _mm_sub_epi32(_mm_castps_si128(normalized), _mm_set1_epi32(GAIN_TABLE_ONE_BITS));
+    index = _mm_add_epi32(_mm_srai_epi32(index, GAIN_TABLE_SHIFT), _mm_set1_epi32(1));
+    index = _mm_andnot_si128(_mm_srai_epi32(index, 31), index);
+    const __m128i last = _mm_set1_epi32(GAIN_TABLE_SIZE - 1);
+    __m128i over = _mm_cmpgt_epi32(index, last);
+    return _mm_or_si128(_mm_andnot_si128(over, index), _mm_and_si128(over, last));
+}
+
+inline __m256i GainTableIndices(__m256 normalized)
+{
+    __m256i index = _mm256_sub_epi32(_mm256_castps_si256(normalized), _mm256_set1_epi32(GAIN_TABLE_ONE_BITS));
+    index = _mm256_add_epi32(_mm256_srai_epi32(index, GAIN_TABLE_SHIFT), _mm256_set1_epi32(1));
+    index = _mm256_max_epi32(index, _mm256_setzero_si256());
+    return _mm256_min_epi32(index, _mm256_set1_epi32(GAIN_TABLE_SIZE - 1));
+}
+
+inline void GainLookupSse2(const double *bins, size_t binCount, const float *inverseThresholds, const float *table, double *gains)
+{
+    alignas(16) int32_t indices[4];
+    size_t i = 0;
+    for (; i + 4 <= binCount; i += 4)
+    {
+        __m128d squared[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            __m128d bin = _mm_loadu_pd(bins + (i + k) * 2);
+            squared[k] = _mm_mul_pd(bin, bin);
+        }
+        __m128d low = _mm_add_pd(_mm_unpacklo_pd(squared[0], squared[1]), _mm_unpackhi_pd(squared[0], squared[1]));
+        __m128d high = _mm_add_pd(_mm_unpacklo_pd(squared[2], squared[3]), _mm_unpackhi_pd(squared[2], squared[3]));
+        __m128 magnitudes = _mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high));
+        __m128 normalized = _mm_mul_ps(magnitudes, _mm_loadu_ps(inverseThresholds + i));
+        _mm_store_si128(reinterpret_cast<__m128i *>(indices), GainTableIndices(normalized));
+        for (int k = 0; k < 4; ++k)
+            gains[i + k] = table[indices[k]];
+    }
+    GainLookupScalar(bins + i * 2, binCount - i, inverseThresholds + i, table, gains + i);
+}
+
+inline void GainLookupSse2(const float *bins, size_t binCount, const float *inverseThresholds, const float *table, float *gains)
+{
+    alignas(16) int32_t indices[4];
+    size_t i = 0;
+    for (; i + 4 <= binCount; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(bins + i * 2);
+        __m128 b = _mm_loadu_ps(bins + i * 2 + 4);
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        __m128 magnitudes = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128 normalized = _mm_mul_ps(magnitudes, _mm_loadu_ps(inverseThresholds + i));
+        _mm_store_si128(reinterpret_cast<__m128i *>(indices), GainTableIndices(normalized));
+        for (int k = 0; k < 4; ++k)
+            gains[i + k] = table[indices[k]];
+    }
+    GainLookupScalar(bins + i * 2, binCount - i, inverseThresholds + i, table, gains + i);
+}
+
+inline void GainLookupAvx2(const double *bins, size_t binCount, const float *inverseThresholds, const float *table, double *gains)
+{
+    size_t i = 0;
+    for (; i + 4 <= binCount; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(bins + i * 2);
+        __m256d b = _mm256_loadu_pd(bins + i * 2 + 4);
+        __m256d magnitudes = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+        magnitudes = _mm256_permute4x64_pd(magnitudes, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128 normalized = _mm_mul_ps(_mm256_cvtpd_ps(magnitudes), _mm_loadu_ps(inverseThresholds + i));
+        __m128 gain = _mm_i32gather_ps(table, GainTableIndices(normalized), 4);
+        _mm256_storeu_pd(gains + i, _mm256_cvtps_pd(gain));
+    }
+    GainLookupScalar(bins + i * 2, binCount - i, inverseThresholds + i, table, gains + i);
+}
+
+inline void GainLookupAvx2(const float *bins, size_t binCount, const float *inverseThresholds, const float *table, float *gains)
+{
+    size_t i = 0;
+    for (; i + 8 <= binCount; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(bins + i * 2);
+        __m256 b = _mm256_loadu_ps(bins + i * 2 + 8);
+        a = _mm256_mul_ps(a, a);
+        b = _mm256_mul_ps(b, b);
+        __m256 magnitudes = _mm256_add_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        magnitudes = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(magnitudes), _MM_SHUFFLE(3, 1, 2, 0)));
+        __m256 normalized = _mm256_mul_ps(magnitudes, _mm256_loadu_ps(inverseThresholds + i));
+        _mm256_storeu_ps(gains + i, _mm256_i32gather_ps(table, GainTableIndices(normalized), 4));
+    }
+    GainLookupScalar(bins + i * 2, binCount - i, inverseThresholds + i, table, gains + i);
+}
+
+inline double FirDotSse2(const double *samples, const double *taps, size_t count)
+{
+    __m128d a = _mm_setzero_pd();
+    __m128d b = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(samples + i), _mm_loadu_pd(taps + i)));
+        b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(samples + i + 2), _mm_loadu_pd(taps + i + 2)));
+    }
+    a = _mm_add_pd(a, b);
+    a = _mm_add_sd(a, _mm_unpackhi_pd(a, a));
+    return _mm_cvtsd_f64(a) + FirDotScalar(samples + i, taps + i, count - i);
+}
+
+inline float FirDotSse2(const float *samples, const float *taps, size_t count)
+{
+    __m128 a = _mm_setzero_ps();
+    __m128 b = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(samples + i), _mm_loadu_ps(taps + i)));
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(samples + i + 4), _mm_loadu_ps(taps + i + 4)));
+    }
+    a = _mm_add_ps(a, b);
+    a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_add_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(a) + FirDotScalar(samples + i, taps + i, count - i);
+}
+
+inline double FirDotAvx2(const double *samples, const double *taps, size_t count)
+{
+    __m256d a = _mm256_setzero_pd();
+    __m256d b = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(samples + i), _mm256_loadu_pd(taps + i)));
+        b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(samples + i + 4), _mm256_loadu_pd(taps + i + 4)));
+    }
+    a = _mm256_add_pd(a, b);
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return _mm_cvtsd_f64(sum) + FirDotScalar(samples + i, taps + i, count - i);
+}
+
+inline float FirDotAvx2(const float *samples, const float *taps, size_t count)
+{
+    __m256 a = _mm256_setzero_ps();
+    __m256 b = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(samples + i), _mm256_loadu_ps(taps + i)));
+        b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8), _mm256_loadu_ps(taps + i + 8)));
+    }
+    a = _mm256_add_ps(a, b);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(sum) + FirDotScalar(samples + i, taps + i, count - i);
+}
+#endif
+
+using GainLookupFn = void (*)(const Sample *, size_t, const float *, const float *, Sample *);
+using FirDotFn = Sample (*)(const Sample *, const Sample *, size_t);
+
+template <float (*Kernel)(const float *, size_t, Sample *, Sample *)>
+Sample DeinterleaveStereoFloat32(const BYTE *data, size_t frameCount, int, Sample *const *planar)
+{
+    return Kernel(reinterpret_cast<const float *>(data), frameCount, planar[0], planar[1]);
+}
+
+// Kernels picked once per stream for the CPU the process runs on.
+struct SimdKernels
+{
+    DeinterleaveFn deinterleaveStereoFloat32 = &DeinterleaveFrames<SampleType::Float32, 2>;
+    GainLookupFn gainLookup = &GainLookupScalar<Sample>;
+    FirDotFn firDot = &FirDotScalar<Sample>;
+
+    static auto ForLevel(SimdLevel level) -> SimdKernels
+    {
+        SimdKernels kernels;
+#if defined(_M_X64) || defined(_M_IX86)
+        if (level == SimdLevel::Avx2)
+        {
+            kernels.deinterleaveStereoFloat32 = &DeinterleaveStereoFloat32<&DeinterleaveStereoAvx2>;
+            kernels.gainLookup = &GainLookupAvx2;
+            kernels.firDot = &FirDotAvx2;
+        }
+        else if (level == SimdLevel::Sse2)
+        {
+            kernels.deinterleaveStereoFloat32 = &DeinterleaveStereoFloat32<&DeinterleaveStereoSse2>;
+            kernels.gainLookup = &GainLookupSse2;
+            kernels.firDot = &FirDotSse2;
+        }
+#endif
+        return kernels;
+    }
+};
+
+template <SampleType Type>
+auto SelectDeinterleave(int channelCount) -> DeinterleaveFn
+{
+    switch (channelCount)
+    {
+    case 1:
+        return &DeinterleaveFrames<Type, 1>;
+    case 2:
+        return &DeinterleaveFrames<Type, 2>;
+    case 4:
+        return &DeinterleaveFrames<Type, 4>;
+    case 6:
+        return &DeinterleaveFrames<Type, 6>;
+    case 8:
+        return &DeinterleaveFrames<Type, 8>;
+    default:
+        return &DeinterleaveFrames<Type, 0>;
+    }
+}
+
+inline auto SelectDeinterleave(const StreamFormat &format, const SimdKernels &kernels) -> DeinterleaveFn
+{
+    if (format.sampleType == SampleType::Float32 && format.channelCount == 2)
+        return kernels.deinterleaveStereoFloat32;
+
+    switch (format.sampleType)
+    {
+    case SampleType::Int16:
+        return SelectDeinterleave<SampleType::Int16>(format.channelCount);
+    case SampleType::Int24:
+        return SelectDeinterleave<SampleType::Int24>(format.channelCount);
+    case SampleType::Int32:
+        return SelectDeinterleave<SampleType::Int32>(format.channelCount);
+    default:
+        return SelectDeinterleave<SampleType::Float32>(format.channelCount);
+    }
+}
+
+// Bins up to upperFrequency (and above the previous band) use this threshold.
+struct CompressorBand
+{
+    double upperFrequency;
+    double threshold;
+};
+
+struct CompressorConfig
+{
+    double threshold = 0.5; // bin magnitude where compression starts, outside every band
+    double ratio = 4.0;
+    double attackMs = 0.0; // 0 follows the target gain within one frame
+    double releaseMs = 0.0;
+    std::vector<CompressorBand> bands; // sorted by upperFrequency
+};
+
+// Spectral compressor for batched transforms. The gain curve is tabulated
+// once from the ratio; per-bin thresholds are refreshed when the transform
+// shape changes. With attack or release, each bin's gain moves towards its
+// target by a one-pole step per frame, attack while it is falling. Prepare
+// runs once per frame; Apply may then run concurrently on disjoint channels.
+class SpectralCompressor
+{
+public:
+    SpectralCompressor(const CompressorConfig &config, GainLookupFn lookup)
+        : config(config), lookup(lookup), table(BuildGainTable(config.ratio))
+    {
+    }
+
+    // Sizes the state for transforms of up to maxTransformSize points, so
+    // Apply never allocates for them.
+    void Reserve(int maxTransformSize, int channelCount)
+    {
+        const size_t maxBins = static_cast<size_t>(maxTransformSize) / 2 + 1;
+        inverseThresholds.reserve(maxBins);
+        gains.reserve(maxBins * channelCount);
+        smoothed.reserve(maxBins * channelCount);
+        remapped.reserve(maxBins * channelCount);
+        Reset();
+    }
+
+    // Drops the smoothing state; the next frame starts from unity gain.
+    void Reset() { binCount = 0; }
+
+    // Sets up a frame of channelCount transforms of transformSize points,
+    // binCount bins each; frameSeconds is the time between successive frames.
+    void Prepare(int binCount, int channelCount, int transformSize, double sampleRate, double frameSeconds)
+    {
+        if (binCount != this->binCount || channelCount != this->channelCount || transformSize != this->transformSize ||
+            sampleRate != this->sampleRate)
+        {
+            Reshape(binCount, channelCount, transformSize, sampleRate);
+        }
+
+        smoothing = config.attackMs > 0.0 || config.releaseMs > 0.0;
+        if (smoothing && frameSeconds != this->frameSeconds)
+        {
+            attack = Coefficient(config.attackMs, frameSeconds);
+            release = Coefficient(config.releaseMs, frameSeconds);
+            this->frameSeconds = frameSeconds;
+        }
+    }
+
+    // spectrum holds the interleaved (re, im) bins of channelCount channels
+    // starting at firstChannel.
+    void Apply(Sample *spectrum, int firstChannel, int channelCount)
+    {
+        for (int block = 0; block < channelCount; ++block)
+        {
+            const size_t channel = static_cast<size_t>(firstChannel + block);
+            Sample *bins = spectrum + static_cast<size_t>(block) * binCount * 2;
+            Sample *channelGains = gains.data() + channel * binCount;
+            lookup(bins, binCount, inverseThresholds.data(), table.data(), channelGains);
+
+            if (smoothing)
+            {
+                Sample *state = smoothed.data() + channel * binCount;
+                for (int i = 0; i < binCount; ++i)
+                {
+                    Sample target = channelGains[i];
+                    state[i] += (target < state[i] ? attack : release) * (target - state[i]);
+                    channelGains[i] = state[i];
+                }
+            }
+
+            for (int i = 0; i < binCount; ++i)
+            {
+                bins[i * 2] *= channelGains[i];
+                bins[i * 2 + 1] *= channelGains[i];
+            }
+        }
+    }
+
+private:
+    void Reshape(int binCount, int channelCount, int transformSize, double sampleRate)
+    {
+        // Packet lengths vary, by a frame at a time when decimating a 44.1 kHz
+        // mix, so a new length alone keeps the smoothing state: each new bin
+        // takes over the old bin nearest to it in frequency.
+        const bool keepState = this->binCount > 0 && channelCount == this->channelCount && sampleRate == this->sampleRate;
+        const int oldBinCount = this->binCount;
+        const int oldTransformSize = this->transformSize;
+
+        this->binCount = binCount;
+        this->channelCount = channelCount;
+        this->transformSize = transformSize;
+        this->sampleRate = sampleRate;
+
+        inverseThresholds.resize(binCount);
+        size_t band = 0;
+        for (int bin = 0; bin < binCount; ++bin)
+        {
+            double frequency = bin * sampleRate / transformSize;
+            while (band < config.bands.size() && frequency > config.bands[band].upperFrequency)
+                ++band;
+            double threshold = band < config.bands.size() ? config.bands[band].threshold : config.threshold;
+            inverseThresholds[bin] = static_cast<float>(1.0 / (threshold * threshold));
+        }
+
+        gains.resize(static_cast<size_t>(binCount) * channelCount);
+        if (!keepState)
+        {
+            smoothed.assign(static_cast<size_t>(binCount) * channelCount, Sample(1));
+            return;
+        }
+
+        remapped.resize(static_cast<size_t>(binCount) * channelCount);
+        for (int channel = 0; channel < channelCount; ++channel)
+        {
+            const Sample *from = smoothed.data() + static_cast<size_t>(channel) * oldBinCount;
+            Sample *to = remapped.data() + static_cast<size_t>(channel) * binCount;
+            for (int bin = 0; bin < binCount; ++bin)
+            {
+                int64_t nearest = (static_cast<int64_t>(bin) * oldTransformSize * 2 + transformSize) / (static_cast<int64_t>(transformSize) * 2);
+                to[bin] = from[std::min<int64_t>(nearest, oldBinCount - 1)];
+            }
+        }
+        smoothed.swap(remapped);
+    }
+
+    static auto Coefficient(double milliseconds, double frameSeconds) -> Sample
+    {
+        return milliseconds > 0.0 ? static_cast<Sample>(1.0 - std::exp(-frameSeconds * 1000.0 / milliseconds)) : Sample(1);
+    }
+
+    CompressorConfig config;
+    GainLookupFn lookup;
+    std::vector<float> table;
+    std::vector<float> inverseThresholds;
+    std::vector<Sample> gains;
+    std::vector<Sample> smoothed;
+    std::vector<Sample> remapped; // scratch for Reshape, swapped with smoothed
+    int binCount = 0;
+    int channelCount = 0;
+    int transformSize = 0;
+    double sampleRate = 0.0;
+    double frameSeconds = 0.0;
+    bool smoothing = false;
+    Sample attack = 1;
+    Sample release = 1;
+};
+
+enum class SpectrumLayout
+{
+    None,
+    Bands,
+    Bins
+};
+
+// Lower edge of the first log-spaced band.
+constexpr double SPECTRUM_LOW_FREQUENCY = 20.0;
+
+// Reduces one channel's half spectrum to a few values, in full-scale units
+// independent of the transform size. Bands split SPECTRUM_LOW_FREQUENCY to
+// Nyquist into count log-spaced bands, each holding the power of the bins
+// centred in it (a full-scale sine has power 0.5). Bins split the spectrum
+// linearly into count groups of transform bins, or one per bin when there are
+// fewer, each holding the RMS amplitude of its group.
+class SpectrumAnalyzer
+{
+public:
+    SpectrumAnalyzer(SpectrumLayout layout, int count) : layout(layout), count(count) { edges.reserve(count + 1); }
+
+    auto ValueCount(int binCount) const -> int { return layout == SpectrumLayout::Bands ? count : std::min(count, binCount); }
+
+    // Sets up the value edges for transforms of transformSize points; Analyze
+    // may then run concurrently on different channels.
+    void Prepare(int binCount, int transformSize, double sampleRate)
+    {
+        if (binCount != this->binCount || transformSize != this->transformSize || sampleRate != this->sampleRate)
+            Reshape(binCount, transformSize, sampleRate);
+    }
+
+    void Analyze(const FFTW::Complex *spectrum, Sample *values) const
+    {
+        const double scale = 1.0 / (static_cast<double>(transformSize) * transformSize);
+        for (size_t value = 0; value + 1 < edges.size(); ++value)
+        {
+            double power = 0.0;
+            for (int bin = edges[value]; bin < edges[value + 1]; ++bin)
+            {
+                // DC and Nyquist have no mirrored bin to fold in.
+                double weight = (bin == 0 || bin * 2 == transformSize) ? 1.0 : 2.0;
+                power += weight * (spectrum[bin][0] * spectrum[bin][0] + spectrum[bin][1] * spectrum[bin][1]);
+            }
+            power *= scale;
+            values[value] = static_cast<Sample>(layout == SpectrumLayout::Bands ? power : std::sqrt(power));
+        }
+    }
+
+private:
+    void Reshape(int binCount, int transformSize, double sampleRate)
+    {
+        this->binCount = binCount;
+        this->transformSize = transformSize;
+        this->sampleRate = sampleRate;
+
+        const int valueCount = ValueCount(binCount);
+        edges.resize(valueCount + 1);
+        if (layout == SpectrumLayout::Bands)
+        {
+            // Edge b is the first bin centred at or above low * ratio^b.
+            const double binsPerHertz = transformSize / sampleRate;
+            const double ratio = std::pow(sampleRate / 2.0 / SPECTRUM_LOW_FREQUENCY, 1.0 / valueCount);
+            for (int band = 0; band < valueCount; ++band)
+            {
+                double edge = std::ceil(SPECTRUM_LOW_FREQUENCY * std::pow(ratio, band) * binsPerHertz);
+                edges[band] = std::clamp(static_cast<int>(edge), band > 0 ? edges[band - 1] : 0, binCount);
+            }
+        }
+        else
+        {
+            for (int group = 0; group < valueCount; ++group)
+                edges[group] = static_cast<int>(static_cast<int64_t>(group) * binCount / valueCount);
+        }
+        edges[valueCount] = binCount;
+    }
+
+    SpectrumLayout layout;
+    int count;
+    std::vector<int> edges;
+    int binCount = 0;
+    int transformSize = 0;
+    double sampleRate = 0.0;
+};
+
+// Taps per output sample; the filter is factor * this long.
+constexpr int DECIMATOR_TAPS_PER_PHASE = 64;
+
+// A Blackman-windowed sinc of L taps falls from passband to its stopband over
+// about this many cycles per sample divided by L.
+constexpr double BLACKMAN_TRANSITION = 5.5;
+
+// Integer-factor polyphase decimator: a linear-phase windowed-sinc low-pass
+// evaluated only at every factor-th input sample. The last taps - 1 inputs of
+// each channel and the phase of the next output carry across packets, so a
+// contiguous stream decimates the same however it is split.
+class Decimator
+{
+public:
+    explicit Decimator(FirDotFn dot) : dot(dot) {}
+
+    // factor 1 turns the stage off. maxFrames bounds the input per packet.
+    void Configure(int factor, int channelCount, size_t maxFrames)
+    {
+        this->factor = factor;
+        phase = 0;
+        buffers.clear();
+        taps.clear();
+        if (factor <= 1)
+            return;
+
+        // Padded with zero taps to a multiple of the widest kernel step.
+        const size_t tapCount = (static_cast<size_t>(factor) * DECIMATOR_TAPS_PER_PHASE + 15) & ~size_t(15);
+        // The cutoff, the -6 dB point, sits half a transition below the output
+        // Nyquist frequency, so everything that would alias is in the
+        // stopband; the passband then reaches 1 - 2 * 5.5 / 64 = 0.83 of it.
+        const double cutoff = (0.5 - 0.5 * BLACKMAN_TRANSITION / DECIMATOR_TAPS_PER_PHASE) / factor; // cycles per input sample
+        const size_t designCount = static_cast<size_t>(factor) * DECIMATOR_TAPS_PER_PHASE;
+        const double center = (designCount - 1) / 2.0;
+        const double pi = 3.14159265358979323846;
+
+        taps.assign(tapCount, Sample(0));
+        double sum = 0.0;
+        for (size_t k = 0; k < designCount; ++k)
+        {
+            double t = k - center;
+            double sinc = t == 0.0 ? 2.0 * cutoff : std::sin(2.0 * pi * cutoff * t) / (pi * t);
+            double window = 0.42 - 0.5 * std::cos(2.0 * pi * k / (designCount - 1)) + 0.08 * std::cos(4.0 * pi * k / (designCount - 1));
+            taps[k] = static_cast<Sample>(sinc * window);
+            sum += sinc * window;
+        }
+        // Unity gain at DC. The taps are symmetric, so no reversal is needed.
+        for (size_t k = 0; k < designCount; ++k)
+            taps[k] = static_cast<Sample>(taps[k] / sum);
+
+        buffers.assign(channelCount, std::vector<Sample>(tapCount - 1 + maxFrames, Sample(0)));
+    }
+
+    auto Factor() const -> int { return factor; }
+
+    // Filters frameCount new samples of each channel and writes the decimated
+    // samples to the front of the same arrays; returns how many there are.
+    auto Process(Sample *const *channels, size_t frameCount) -> size_t
+    {
+        if (factor <= 1)
+            return frameCount;
+
+        const size_t historyCount = taps.size() - 1;
+        size_t outputCount = 0;
+        for (size_t channel = 0; channel < buffers.size(); ++channel)
+        {
+            auto &buffer = buffers[channel];
+            if (buffer.size() < historyCount + frameCount)
+                buffer.resize(historyCount + frameCount);
+
+            std::copy(channels[channel], channels[channel] + frameCount, buffer.data() + historyCount);
+            outputCount = 0;
+            for (size_t position = phase; position < frameCount; position += factor)
+                channels[channel][outputCount++] = dot(buffer.data() + position, taps.data(), taps.size());
+            std::copy(buffer.data() + frameCount, buffer.data() + frameCount + historyCount, buffer.data());
+        }
+        Advance(frameCount, outputCount);
+        return outputCount;
+    }
+
+    // Advances over frameCount frames of silence without filtering them and
+    // returns how many output frames they stand for.
+    auto Skip(size_t frameCount) -> size_t
+    {
+        if (factor <= 1)
+            return frameCount;
+
+        size_t outputCount = phase < frameCount ? (frameCount - phase + factor - 1) / factor : 0;
+        for (auto &buffer : buffers)
+            std::fill(buffer.begin(), buffer.begin() + (taps.size() - 1), Sample(0));
+        Advance(frameCount, outputCount);
+        return outputCount;
+    }
+
+private:
+    void Advance(size_t frameCount, size_t outputCount)
+    {
+        phase = phase + outputCount * factor - frameCount;
+    }
+
+    FirDotFn dot;
+    int factor = 1;
+    size_t phase = 0; // input frames before the next output, counted from the next packet
+    std::vector<Sample> taps;
+    std::vector<std::vector<Sample>> buffers;
+};
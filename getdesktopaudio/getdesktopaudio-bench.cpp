@@ -0,0 +1,784 @@
+﻿#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include "capturefile.h"
+#include "processor.h"
+#include "transport.h"
+#include <nlohmann/json.hpp>
+
+// Feeds synthetic or recorded packets through PacketProcessor without a
+// device and reports, for every -samples size and channel count, the cost per
+// frame, heap allocations per packet and per-stage latency percentiles.
+
+// Every heap allocation on the benchmark thread is counted, in all builds.
+struct AllocationCounter
+{
+    static inline thread_local uint64_t count = 0;
+};
+
+void *operator new(size_t size)
+{
+    ++AllocationCounter::count;
+    if (void *pointer = std::malloc(size ? size : 1))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+// Packets run before measuring, so plan creation and buffer growth are excluded.
+constexpr int BENCH_WARMUP_PACKETS = 64;
+
+constexpr double BENCH_SAMPLE_RATE = 48000.0;
+
+// Swallows records and keeps their size so the serializer cannot be optimized
+// away. The last record stays readable until the processor writes the next.
+class CountingSink : public OutputSink
+{
+public:
+    void Write(const void *data, size_t size, bool) override
+    {
+        bytes += size;
+        last = std::string_view(static_cast<const char *>(data), size);
+    }
+
+    uint64_t bytes = 0;
+    std::string_view last;
+};
+
+// The tree JSON records were built in before JsonWriter, with the same float
+// type, so its dump() gives the bytes JsonWriter has to match.
+using ReferenceJson = nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t, std::uint64_t, Sample>;
+
+// A sample record the way it was written before JsonWriter: a tree per packet,
+// then dump(). The benchmark neither tags streams nor writes spectra.
+auto DumpReferenceJson(const PacketProcessor &processor, const CapturedPacket &packet) -> std::string
+{
+    const auto &channels = processor.GetChannels();
+    ReferenceJson record;
+    record["leftSamples"] = channels[0];
+    record["rightSamples"] = channels.size() > 1 ? channels[1] : channels[0];
+    if (channels.size() > 2)
+        record["channels"] = channels;
+    record["devicePosition"] = packet.devicePosition;
+    record["qpcPosition"] = packet.qpcPosition;
+    record["discontinuity"] = (packet.flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) != 0 || packet.gapFrames > 0;
+    record["gapFrames"] = packet.gapFrames;
+    return record.dump() + '\n';
+}
+
+// Keeps every record, for checks that read the output back.
+class CollectingSink : public OutputSink
+{
+public:
+    void Write(const void *data, size_t size, bool) override
+    {
+        const BYTE *record = static_cast<const BYTE *>(data);
+        bytes.insert(bytes.end(), record, record + size);
+    }
+
+    std::vector<BYTE> bytes;
+};
+
+// Interleaved float32 frames, either generated or read from a raw capture.
+struct SourceAudio
+{
+    std::vector<float> samples;
+    int channelCount = 0;
+
+    auto FrameCount() const -> size_t { return samples.size() / channelCount; }
+};
+
+// A sine per channel with a little noise, so the compressor sees bins on both
+// sides of its threshold.
+auto MakeSyntheticAudio(int channelCount, size_t frameCount) -> SourceAudio
+{
+    SourceAudio audio;
+    audio.channelCount = channelCount;
+    audio.samples.resize(frameCount * channelCount);
+
+    uint32_t noise = 0x12345678;
+    for (size_t frame = 0; frame < frameCount; ++frame)
+    {
+        for (int channel = 0; channel < channelCount; ++channel)
+        {
+            noise = noise * 1664525u + 1013904223u;
+            double tone = 0.6 * std::sin(2.0 * 3.14159265358979323846 * (220.0 * (channel + 1)) * frame / BENCH_SAMPLE_RATE);
+            double hiss = (static_cast<double>(noise >> 8) / 16777216.0 - 0.5) * 0.02;
+            audio.samples[frame * channelCount + channel] = static_cast<float>(tone + hiss);
+        }
+    }
+    return audio;
+}
+
+auto LoadRecordedAudio(const char *path, int channelCount) -> SourceAudio
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open input file.");
+    }
+
+    std::streamsize size = file.tellg();
+    file.seekg(0);
+
+    SourceAudio audio;
+    audio.channelCount = channelCount;
+    audio.samples.resize(static_cast<size_t>(size) / sizeof(float) / channelCount * channelCount);
+    file.read(reinterpret_cast<char *>(audio.samples.data()), audio.samples.size() * sizeof(float));
+
+    if (audio.samples.empty())
+    {
+        throw std::runtime_error("Input file holds no complete frames.");
+    }
+    return audio;
+}
+
+// Copies the next frameCount frames of source to destination, wrapping around
+// the source so recorded input of any length works.
+void CopySourceFrames(const SourceAudio &source, size_t &cursor, BYTE *destination, UINT32 frameCount)
+{
+    const size_t frameBytes = source.channelCount * sizeof(float);
+    for (UINT32 copied = 0; copied < frameCount;)
+    {
+        size_t take = std::min<size_t>(frameCount - copied, source.FrameCount() - cursor);
+        std::memcpy(destination + copied * frameBytes, source.samples.data() + cursor * source.channelCount, take * frameBytes);
+        copied += static_cast<UINT32>(take);
+        cursor = (cursor + take) % source.FrameCount();
+    }
+}
+
+auto ParseList(const char *text) -> std::vector<int>
+{
+    std::vector<int> values;
+    for (const char *cursor = text; *cursor;)
+    {
+        char *end = nullptr;
+        long value = std::strtol(cursor, &end, 10);
+        if (end == cursor || value <= 0)
+            throw std::invalid_argument("Lists must be comma-separated positive integers.");
+        values.push_back(static_cast<int>(value));
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+auto Percentile(std::vector<uint64_t> &sorted, double quantile) -> double
+{
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(quantile * sorted.size()));
+    return static_cast<double>(sorted[index]);
+}
+
+struct StageTimes
+{
+    std::vector<uint64_t> dsp;
+    std::vector<uint64_t> serialize;
+    std::vector<uint64_t> total;
+    std::vector<uint64_t> reference;
+};
+
+void PrintStage(const char *name, std::vector<uint64_t> &times)
+{
+    std::sort(times.begin(), times.end());
+    std::printf("  %-10s p50 %9.0f  p99 %9.0f  p999 %9.0f ns\n", name, Percentile(times, 0.50), Percentile(times, 0.99),
+                Percentile(times, 0.999));
+}
+
+// With jsonReference, every measured JSON record is also built and dumped
+// through ReferenceJson; that is timed on its own and has to match byte for byte.
+void RunConfiguration(const ProcessingOptions &options, FFTPlanCache &planCache, const SourceAudio &source, int sampleCount,
+                      int packetCount, bool jsonReference)
+{
+    // -samples counts stereo samples, so each packet carries half as many frames.
+    const UINT32 packetFrames = static_cast<UINT32>(std::max(sampleCount / 2, 1));
+    const int channelCount = source.channelCount;
+
+    StreamFormat streamFormat;
+    streamFormat.sampleType = SampleType::Float32;
+    streamFormat.channelCount = channelCount;
+    streamFormat.bytesPerFrame = channelCount * static_cast<int>(sizeof(float));
+    streamFormat.sampleRate = static_cast<DWORD>(BENCH_SAMPLE_RATE);
+
+    CountingSink sink;
+    PacketProcessor processor(options, planCache, sink);
+    processor.Configure(streamFormat, packetFrames);
+    processor.PreparePlans(sampleCount);
+
+    CapturedPacket packet;
+    packet.data.resize(static_cast<size_t>(packetFrames) * streamFormat.bytesPerFrame);
+    packet.frameCount = packetFrames;
+
+    StageTimes times;
+    times.dsp.reserve(packetCount);
+    times.serialize.reserve(packetCount);
+    times.total.reserve(packetCount);
+    times.reference.reserve(jsonReference ? packetCount : 0);
+
+    size_t cursor = 0;
+    uint64_t allocations = 0;
+    uint64_t frames = 0;
+
+    for (int i = 0; i < BENCH_WARMUP_PACKETS + packetCount; ++i)
+    {
+        CopySourceFrames(source, cursor, packet.data.data(), packetFrames);
+        packet.devicePosition += packetFrames;
+        packet.qpcPosition = packet.devicePosition * 10000000ull / streamFormat.sampleRate;
+
+        uint64_t allocationsBefore = AllocationCounter::count;
+        auto start = std::chrono::steady_clock::now();
+        bool silent = processor.ProcessAudio(packet, sampleCount);
+        auto processed = std::chrono::steady_clock::now();
+        processor.WriteRecord(packet, silent);
+        auto written = std::chrono::steady_clock::now();
+
+        if (i < BENCH_WARMUP_PACKETS)
+            continue;
+
+        allocations += AllocationCounter::count - allocationsBefore;
+        frames += packetFrames;
+        times.dsp.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(processed - start).count());
+        times.serialize.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(written - processed).count());
+        times.total.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(written - start).count());
+
+        if (jsonReference)
+        {
+            auto referenceStart = std::chrono::steady_clock::now();
+            std::string reference = DumpReferenceJson(processor, packet);
+            auto referenceEnd = std::chrono::steady_clock::now();
+            times.reference.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(referenceEnd - referenceStart).count());
+            if (sink.last != reference)
+            {
+                throw std::runtime_error("JSON record differs from the nlohmann::json reference.");
+            }
+        }
+    }
+    processor.Flush();
+
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t time : times.total)
+        totalNanoseconds += time;
+
+    std::printf("samples %d, channels %d: %.1f ns/frame, %.2f allocations/packet, %.1f bytes/packet\n", sampleCount, channelCount,
+                static_cast<double>(totalNanoseconds) / frames, static_cast<double>(allocations) / packetCount,
+                static_cast<double>(sink.bytes) / (BENCH_WARMUP_PACKETS + packetCount));
+    PrintStage("dsp", times.dsp);
+    PrintStage("serialize", times.serialize);
+    PrintStage("total", times.total);
+    if (jsonReference)
+    {
+        PrintStage("reference", times.reference);
+        std::printf("  serialize is %.2fx faster than the reference at p50\n", Percentile(times.reference, 0.50) / Percentile(times.serialize, 0.50));
+    }
+}
+
+// Runs a -record capture file through the processor at full speed, packet
+// for packet as it was captured, looping it until packetCount are measured.
+void RunReplay(const ProcessingOptions &options, FFTPlanCache &planCache, CaptureFileReader &reader, int sampleCount, int packetCount)
+{
+    if (reader.GetPacketCount() == 0)
+    {
+        throw std::runtime_error("Capture file holds no packets.");
+    }
+
+    CountingSink sink;
+    PacketProcessor processor(options, planCache, sink);
+
+    CapturedPacket packet;
+    CaptureFileReader::Record record;
+    int channelCount = 0;
+
+    StageTimes times;
+    times.dsp.reserve(packetCount);
+    times.serialize.reserve(packetCount);
+    times.total.reserve(packetCount);
+
+    uint64_t allocations = 0;
+    uint64_t frames = 0;
+    reader.Rewind();
+
+    for (int i = 0; i < BENCH_WARMUP_PACKETS + packetCount;)
+    {
+        if (!reader.Next(record))
+        {
+            reader.Rewind();
+            continue;
+        }
+        if (record.kind == CaptureRecordKind::Format)
+        {
+            // Outside the timed region, like a reconnect in the capture path.
+            processor.Configure(record.format, reader.GetMaxPacketFrames());
+            processor.PreparePlans(sampleCount);
+            packet.data.resize(static_cast<size_t>(reader.GetMaxPacketFrames()) * record.format.bytesPerFrame);
+            channelCount = record.format.channelCount;
+            continue;
+        }
+
+        packet.frameCount = record.header.frameCount;
+        packet.flags = record.header.flags;
+        packet.devicePosition = record.header.devicePosition;
+        packet.qpcPosition = record.header.qpcPosition;
+        packet.gapFrames = record.header.gapFrames;
+        std::memcpy(packet.data.data(), record.data, record.header.size);
+
+        uint64_t allocationsBefore = AllocationCounter::count;
+        auto start = std::chrono::steady_clock::now();
+        bool silent = processor.ProcessAudio(packet, sampleCount);
+        auto processed = std::chrono::steady_clock::now();
+        processor.WriteRecord(packet, silent);
+        auto written = std::chrono::steady_clock::now();
+
+        if (i++ < BENCH_WARMUP_PACKETS)
+            continue;
+
+        allocations += AllocationCounter::count - allocationsBefore;
+        frames += packet.frameCount;
+        times.dsp.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(processed - start).count());
+        times.serialize.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(written - processed).count());
+        times.total.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(written - start).count());
+    }
+    processor.Flush();
+
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t time : times.total)
+        totalNanoseconds += time;
+
+    std::printf("replay, samples %d, channels %d: %.1f ns/frame, %.2f allocations/packet, %.1f bytes/packet\n", sampleCount, channelCount,
+                static_cast<double>(totalNanoseconds) / std::max<uint64_t>(frames, 1), static_cast<double>(allocations) / packetCount,
+                static_cast<double>(sink.bytes) / (BENCH_WARMUP_PACKETS + packetCount));
+    PrintStage("dsp", times.dsp);
+    PrintStage("serialize", times.serialize);
+    PrintStage("total", times.total);
+}
+
+// Every this many packets is flagged silent, so silence records are checked too.
+constexpr int PACKED_CHECK_SILENCE_PERIOD = 7;
+
+// Half a quantization step, plus float32 rounding of the binary reference.
+constexpr double PACKED_CHECK_TOLERANCE = 0.5 / PACKED_SCALE + 1e-7;
+
+// Runs the same packets through a binary and a packed processor, decodes the
+// packed frames with PackedDecoder and fails unless every packet matches its
+// binary frame and every sample is within PACKED_CHECK_TOLERANCE of it.
+void RunPackedCheck(const ProcessingOptions &options, FFTPlanCache &planCache, const SourceAudio &source, int sampleCount,
+                    int packetCount)
+{
+    const UINT32 packetFrames = static_cast<UINT32>(std::max(sampleCount / 2, 1));
+    const int channelCount = source.channelCount;
+
+    StreamFormat streamFormat;
+    streamFormat.sampleType = SampleType::Float32;
+    streamFormat.channelCount = channelCount;
+    streamFormat.bytesPerFrame = channelCount * static_cast<int>(sizeof(float));
+    streamFormat.sampleRate = static_cast<DWORD>(BENCH_SAMPLE_RATE);
+
+    ProcessingOptions binaryOptions = options;
+    binaryOptions.format = OutputFormat::Binary;
+    binaryOptions.silenceOutput = SilenceOutput::Record;
+    ProcessingOptions packedOptions = binaryOptions;
+    packedOptions.format = OutputFormat::Packed;
+
+    CollectingSink binarySink;
+    CollectingSink packedSink;
+    PacketProcessor binary(binaryOptions, planCache, binarySink);
+    PacketProcessor packed(packedOptions, planCache, packedSink);
+    binary.Configure(streamFormat, packetFrames);
+    packed.Configure(streamFormat, packetFrames);
+
+    CapturedPacket packet;
+    packet.data.resize(static_cast<size_t>(packetFrames) * streamFormat.bytesPerFrame);
+    packet.frameCount = packetFrames;
+
+    size_t cursor = 0;
+    for (int i = 0; i < packetCount; ++i)
+    {
+        CopySourceFrames(source, cursor, packet.data.data(), packetFrames);
+        packet.flags = i % PACKED_CHECK_SILENCE_PERIOD == PACKED_CHECK_SILENCE_PERIOD - 1 ? AUDCLNT_BUFFERFLAGS_SILENT : 0;
+        packet.devicePosition += packetFrames;
+        packet.qpcPosition = packet.devicePosition * 10000000ull / streamFormat.sampleRate;
+        binary.Process(packet, sampleCount);
+        packed.Process(packet, sampleCount);
+    }
+    binary.Flush();
+    packed.Flush();
+
+    PackedDecoder decoder;
+    size_t packedOffset = 0;
+    size_t binaryOffset = 0;
+    uint64_t packets = 0;
+    double maxError = 0.0;
+    while (packedOffset < packedSink.bytes.size())
+    {
+        size_t frameSize = decoder.Decode(packedSink.bytes.data() + packedOffset, packedSink.bytes.size() - packedOffset);
+        if (frameSize == 0)
+        {
+            throw std::runtime_error("Packed output ends inside a frame.");
+        }
+        packedOffset += frameSize;
+
+        for (const PackedDecoder::Packet &decoded : decoder.Packets())
+        {
+            BinaryFrameHeader header{};
+            if (binarySink.bytes.size() - binaryOffset < sizeof(header))
+            {
+                throw std::runtime_error("Packed output holds more packets than binary output.");
+            }
+            std::memcpy(&header, binarySink.bytes.data() + binaryOffset, sizeof(header));
+            binaryOffset += sizeof(header);
+
+            if (header.sequence != decoded.sequence || header.qpcPosition != decoded.header.qpcPosition ||
+                header.devicePosition != decoded.header.devicePosition || header.flags != decoded.header.flags ||
+                header.gapFrames != decoded.header.gapFrames || header.frameCount != decoded.header.frameCount ||
+                header.channelCount != decoder.Header().channelCount)
+            {
+                throw std::runtime_error("Packed packet header does not match its binary frame.");
+            }
+            ++packets;
+            if (header.flags & BINARY_FLAG_SILENCE)
+                continue;
+
+            const size_t sampleBytes = static_cast<size_t>(header.frameCount) * header.channelCount * sizeof(float);
+            if (binarySink.bytes.size() - binaryOffset < sampleBytes)
+            {
+                throw std::runtime_error("Binary output ends inside a frame.");
+            }
+            const BYTE *samples = binarySink.bytes.data() + binaryOffset;
+            binaryOffset += sampleBytes;
+
+            for (size_t frame = 0; frame < header.frameCount; ++frame)
+            {
+                for (size_t channel = 0; channel < header.channelCount; ++channel)
+                {
+                    float value;
+                    std::memcpy(&value, samples + (frame * header.channelCount + channel) * sizeof(float), sizeof(value));
+                    double expected = std::clamp(static_cast<double>(value), -1.0, 1.0);
+                    maxError = std::max(maxError, std::fabs(static_cast<double>(decoded.channels[channel][frame]) - expected));
+                }
+            }
+        }
+    }
+
+    std::printf("packed check, samples %d, channels %d: %llu packets, %.1f%% of binary size, max error %.3g (limit %.3g)\n", sampleCount,
+                channelCount, static_cast<unsigned long long>(packets), 100.0 * packedSink.bytes.size() / std::max<size_t>(binarySink.bytes.size(), 1),
+                maxError, PACKED_CHECK_TOLERANCE);
+    if (packets != static_cast<uint64_t>(packetCount) || binaryOffset != binarySink.bytes.size() || maxError > PACKED_CHECK_TOLERANCE)
+    {
+        throw std::runtime_error("Packed round-trip check failed.");
+    }
+}
+
+// A ring small enough that the writer laps a slow reader many times.
+constexpr uint64_t SHM_CHECK_CAPACITY = 1 << 16;
+
+constexpr uint64_t SHM_CHECK_YIELD_RECORDS = 24;
+
+// Size and contents of check record sequence, so a reader can tell a torn one.
+auto ShmCheckRecordSize(uint64_t sequence) -> size_t { return sizeof(uint64_t) + sequence * 2654435761u % 4000; }
+
+auto ShmCheckByte(uint64_t sequence, size_t index) -> BYTE { return static_cast<BYTE>(sequence * 31 + index); }
+
+// Writes recordCount records of varying size through a SharedMemorySink on
+// another thread while this one reads them back with SharedRingReader, and
+// fails if any record read is not exactly one the writer wrote.
+void RunSharedRingCheck(int recordCount)
+{
+    const std::wstring name = L"getdesktopaudio-bench-" + std::to_wstring(GetCurrentProcessId());
+    SharedMemorySink sink(name, SHM_CHECK_CAPACITY);
+    SharedRingReader reader(name);
+
+    std::atomic<bool> done{false};
+    std::thread writer([&]()
+                       {
+        std::vector<BYTE> record;
+        for (uint64_t sequence = 0; sequence < static_cast<uint64_t>(recordCount); ++sequence)
+        {
+            record.resize(ShmCheckRecordSize(sequence));
+            std::memcpy(record.data(), &sequence, sizeof(sequence));
+            for (size_t i = sizeof(sequence); i < record.size(); ++i)
+                record[i] = ShmCheckByte(sequence, i);
+            sink.Write(record.data(), record.size(), false);
+            // Lets a reader on the same core in now and then, so it falls
+            // behind a varying distance rather than always a whole slice.
+            if (sequence % SHM_CHECK_YIELD_RECORDS == 0)
+                std::this_thread::yield();
+        }
+        done.store(true, std::memory_order_release); });
+
+    std::vector<BYTE> record;
+    uint64_t records = 0;
+    uint64_t losses = 0;
+    uint64_t corrupt = 0;
+    uint64_t previous = 0;
+    while (true)
+    {
+        const bool finished = done.load(std::memory_order_acquire);
+        SharedRingReader::Result result;
+        while ((result = reader.Read(record)) != SharedRingReader::Result::Empty)
+        {
+            if (result == SharedRingReader::Result::Lost)
+            {
+                ++losses;
+                continue;
+            }
+
+            uint64_t sequence = UINT64_MAX;
+            if (record.size() >= sizeof(sequence))
+                std::memcpy(&sequence, record.data(), sizeof(sequence));
+            bool intact = sequence < static_cast<uint64_t>(recordCount) && record.size() == ShmCheckRecordSize(sequence) &&
+                          (records == 0 || sequence > previous);
+            for (size_t i = sizeof(sequence); intact && i < record.size(); ++i)
+                intact = record[i] == ShmCheckByte(sequence, i);
+            corrupt += intact ? 0 : 1;
+            previous = sequence;
+            ++records;
+        }
+        if (finished)
+            break;
+        std::this_thread::yield();
+    }
+    writer.join();
+
+    std::printf("shm ring: %d records written, %llu read, %llu losses, %llu corrupt\n", recordCount,
+                static_cast<unsigned long long>(records), static_cast<unsigned long long>(losses), static_cast<unsigned long long>(corrupt));
+    if (corrupt > 0 || previous != static_cast<uint64_t>(recordCount) - 1)
+    {
+        throw std::runtime_error("Shared memory ring check failed.");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        ProcessingOptions options;
+        options.simdLevel = DetectSimdLevel();
+        std::vector<int> sampleCounts = {64, 256, 1024, 4096};
+        std::vector<int> channelCounts = {1, 2, 6, 8};
+        int packetCount = 2000;
+        const char *inputPath = nullptr;
+        int inputChannels = 2;
+        const char *replayPath = nullptr;
+        int shmCheckRecords = 0;
+        bool packedCheck = false;
+        bool jsonReference = false;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc)
+            {
+                sampleCounts = ParseList(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-channels") == 0 && i + 1 < argc)
+            {
+                channelCounts = ParseList(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-packets") == 0 && i + 1 < argc)
+            {
+                packetCount = atoi(argv[++i]);
+                if (packetCount <= 0)
+                    throw std::invalid_argument("Packet count must be positive.");
+            }
+            else if (strcmp(argv[i], "-input") == 0 && i + 1 < argc)
+            {
+                inputPath = argv[++i];
+            }
+            else if (strcmp(argv[i], "-shm-check") == 0 && i + 1 < argc)
+            {
+                shmCheckRecords = atoi(argv[++i]);
+                if (shmCheckRecords <= 0)
+                    throw std::invalid_argument("Record count must be positive.");
+            }
+            else if (strcmp(argv[i], "-packed-check") == 0)
+            {
+                // Round-trips every configuration through PackedDecoder instead of timing it.
+                packedCheck = true;
+            }
+            else if (strcmp(argv[i], "-json-reference") == 0)
+            {
+                // Times nlohmann::json's dump() next to JsonWriter and checks they agree.
+                jsonReference = true;
+            }
+            else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+            {
+                replayPath = argv[++i];
+            }
+            else if (strcmp(argv[i], "-input-channels") == 0 && i + 1 < argc)
+            {
+                inputChannels = atoi(argv[++i]);
+                if (inputChannels <= 0)
+                    throw std::invalid_argument("Input channel count must be positive.");
+            }
+            else if (strcmp(argv[i], "-format") == 0 && i + 1 < argc)
+            {
+                const char *format = argv[++i];
+                if (strcmp(format, "json") == 0)
+                    options.format = OutputFormat::Json;
+                else if (strcmp(format, "binary") == 0)
+                    options.format = OutputFormat::Binary;
+                else if (strcmp(format, "packed") == 0)
+                    options.format = OutputFormat::Packed;
+                else
+                    throw std::invalid_argument("Format must be json, binary or packed.");
+            }
+            else if (strcmp(argv[i], "-json-precision") == 0 && i + 1 < argc)
+            {
+                options.jsonPrecision = atoi(argv[++i]);
+                if (options.jsonPrecision <= 0 || options.jsonPrecision > JsonWriter::MAX_FIXED_PRECISION)
+                    throw std::invalid_argument("JSON precision must be between 1 and 17 decimals.");
+            }
+            else if (strcmp(argv[i], "-packed-batch") == 0 && i + 1 < argc)
+            {
+                options.packedBatch = atoi(argv[++i]);
+                if (options.packedBatch <= 0 || options.packedBatch > UINT16_MAX)
+                    throw std::invalid_argument("Packed batch must be between 1 and 65535 packets.");
+            }
+            else if (strcmp(argv[i], "-simd") == 0 && i + 1 < argc)
+            {
+                const char *level = argv[++i];
+                if (strcmp(level, "avx2") == 0)
+                    options.simdLevel = SimdLevel::Avx2;
+                else if (strcmp(level, "sse2") == 0)
+                    options.simdLevel = SimdLevel::Sse2;
+                else if (strcmp(level, "scalar") == 0)
+                    options.simdLevel = SimdLevel::Scalar;
+                else if (strcmp(level, "auto") != 0)
+                    throw std::invalid_argument("SIMD level must be auto, avx2, sse2 or scalar.");
+            }
+            else if (strcmp(argv[i], "-stft") == 0 && i + 1 < argc)
+            {
+                options.stftFrameSize = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-hop") == 0 && i + 1 < argc)
+            {
+                options.stftHop = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-spectrum") == 0 && i + 1 < argc)
+            {
+                const char *spectrum = argv[++i];
+                if (strncmp(spectrum, "bands:", 6) == 0)
+                    options.spectrumLayout = SpectrumLayout::Bands;
+                else if (strncmp(spectrum, "bins:", 5) == 0)
+                    options.spectrumLayout = SpectrumLayout::Bins;
+                else
+                    throw std::invalid_argument("Spectrum must be bands:<count> or bins:<count>.");
+                options.spectrumCount = atoi(strchr(spectrum, ':') + 1);
+                if (options.spectrumCount <= 0)
+                    throw std::invalid_argument("Spectrum count must be positive.");
+            }
+            else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+            {
+                options.workerCount = atoi(argv[++i]);
+                if (options.workerCount < 0)
+                    throw std::invalid_argument("Worker count must not be negative.");
+            }
+            else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc)
+            {
+                options.outputRate = atoi(argv[++i]);
+                if (options.outputRate <= 0)
+                    throw std::invalid_argument("Output rate must be positive.");
+            }
+            else if (strcmp(argv[i], "-attack") == 0 && i + 1 < argc)
+            {
+                options.compressor.attackMs = atof(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-release") == 0 && i + 1 < argc)
+            {
+                options.compressor.releaseMs = atof(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc)
+            {
+                options.compressor.threshold = atof(argv[++i]);
+                if (options.compressor.threshold <= 0.0)
+                    throw std::invalid_argument("Threshold must be positive.");
+            }
+            else if (strcmp(argv[i], "-ratio") == 0 && i + 1 < argc)
+            {
+                options.compressor.ratio = atof(argv[++i]);
+                if (options.compressor.ratio < 1.0)
+                    throw std::invalid_argument("Ratio must be at least 1.");
+            }
+            else if (strcmp(argv[i], "-band") == 0 && i + 1 < argc)
+            {
+                // <upper frequency in Hz>:<threshold>, repeatable, as for the capture tool.
+                CompressorBand band{};
+                if (sscanf(argv[++i], "%lf:%lf", &band.upperFrequency, &band.threshold) != 2 || band.upperFrequency <= 0.0 ||
+                    band.threshold <= 0.0)
+                    throw std::invalid_argument("Band must be <frequency>:<threshold> with both positive.");
+                options.compressor.bands.push_back(band);
+            }
+        }
+
+        std::sort(options.compressor.bands.begin(), options.compressor.bands.end(),
+                  [](const CompressorBand &a, const CompressorBand &b) { return a.upperFrequency < b.upperFrequency; });
+
+        if (options.simdLevel > DetectSimdLevel())
+            throw std::invalid_argument("Requested SIMD level is not supported by this CPU.");
+
+        if (jsonReference && (options.format != OutputFormat::Json || options.spectrumLayout != SpectrumLayout::None || replayPath))
+            throw std::invalid_argument("-json-reference needs JSON sample records from synthetic or -input audio.");
+
+        if (shmCheckRecords > 0)
+        {
+            RunSharedRingCheck(shmCheckRecords);
+            return EXIT_SUCCESS;
+        }
+
+        if (replayPath)
+        {
+            CaptureFileReader reader(replayPath);
+            FFTPlanCache planCache(options.plannerFlags);
+            for (int sampleCount : sampleCounts)
+                RunReplay(options, planCache, reader, sampleCount, packetCount);
+            return EXIT_SUCCESS;
+        }
+
+        // Recorded input fixes the channel count; synthetic input covers the matrix.
+        std::vector<SourceAudio> sources;
+        if (inputPath)
+        {
+            sources.push_back(LoadRecordedAudio(inputPath, inputChannels));
+        }
+        else
+        {
+            for (int channelCount : channelCounts)
+                sources.push_back(MakeSyntheticAudio(channelCount, static_cast<size_t>(BENCH_SAMPLE_RATE)));
+        }
+
+        FFTPlanCache planCache(options.plannerFlags);
+        for (const SourceAudio &source : sources)
+        {
+            for (int sampleCount : sampleCounts)
+            {
+                if (packedCheck)
+                    RunPackedCheck(options, planCache, source, sampleCount, packetCount);
+                else
+                    RunConfiguration(options, planCache, source, sampleCount, packetCount, jsonReference);
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,30 +1,165 @@
 ﻿#include <iostream>
 #include <audioclient.h>
 #include <mmdeviceapi.h>
+#include <audioclientactivationparams.h>
+#include <functiondiscoverykeys_devpkey.h>
 #include <comdef.h>
 #include <vector>
 #include <algorithm>
 #include <cmath>
-#include <nlohmann/json.hpp>
 #include <memory>
 #include <format>
 #include <stdexcept>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <optional>
 #include <atlbase.h>
-#include <complex>
-#include <fftw3.h>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <cstdio>
+#include <io.h>
+#include <fcntl.h>
+#include <cstring>
 
 #define NOMINMAX
 #include <windows.h>
 #undef NOMINMAX
+#include <avrt.h>
 
-using json = nlohmann::json;
+#include "capturefile.h"
+#include "processor.h"
+#include "transport.h"
+
+#ifdef _DEBUG
+// Debug builds count heap allocations per thread so the processing thread can
+// verify that its steady state is allocation-free.
+struct AllocationCounter
+{
+    static inline thread_local uint64_t count = 0;
+};
+
+void *operator new(size_t size)
+{
+    ++AllocationCounter::count;
+    if (void *pointer = std::malloc(size ? size : 1))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+// Packets processed before allocations on the processing thread count as a regression.
+constexpr uint64_t ALLOCATION_WARMUP_PACKETS = 64;
+#endif
 
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "oleaut32.lib")
 #pragma comment(lib, "uuid.lib")
 #pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "avrt.lib")
+#pragma comment(lib, "mmdevapi.lib")
+
+enum class CaptureMode
+{
+    Event,
+    Polling
+};
+
+constexpr size_t BINARY_STDOUT_BUFFER_SIZE = 1 << 16;
+
+// Shared-mode buffer the event-driven mode requests unless -buffer-ms says
+// otherwise, in 100-nanosecond units.
+constexpr REFERENCE_TIME CAPTURE_BUFFER_DURATION = 200000;
+
+// How long the event-driven loop waits before re-checking isRunning.
+constexpr DWORD CAPTURE_EVENT_TIMEOUT_MS = 2000;
+
+// How long the processing thread waits for a packet before re-checking isRunning.
+constexpr DWORD PROCESSING_WAIT_TIMEOUT_MS = 100;
+
+// How long ActivateAudioInterfaceAsync may take to hand over a client.
+constexpr DWORD PROCESS_ACTIVATION_TIMEOUT_MS = 5000;
+
+// Process loopback clients have no mix format; the engine converts to this.
+constexpr DWORD PROCESS_LOOPBACK_SAMPLE_RATE = 48000;
+constexpr WORD PROCESS_LOOPBACK_CHANNELS = 2;
+
+// How long a lost stream waits between attempts to reopen its endpoint.
+constexpr DWORD RECONNECT_RETRY_MS = 500;
+
+struct CaptureOptions : ProcessingOptions
+{
+    CaptureMode mode = CaptureMode::Event;
+    REFERENCE_TIME bufferDuration = 0; // 0 picks the mode's default
+    bool lowLatency = false;           // IAudioClient3 stream at the engine's minimum period
+    size_t ringCapacity = 64;
+    bool useMmcss = false;
+    AVRT_PRIORITY mmcssPriority = AVRT_PRIORITY_HIGH;
+};
+
+struct ComReleaser
+{
+    void operator()(IUnknown *object) const { object->Release(); }
+};
+
+using AudioClientPtr = std::unique_ptr<IAudioClient, ComReleaser>;
+using CaptureClientPtr = std::unique_ptr<IAudioCaptureClient, ComReleaser>;
+
+// The endpoint behind a client is gone for good; only a new client helps.
+inline bool IsDeviceLost(HRESULT hr)
+{
+    return hr == AUDCLNT_E_DEVICE_INVALIDATED || hr == AUDCLNT_E_SERVICE_NOT_RUNNING;
+}
+
+inline auto ToUtf8(const std::wstring &text) -> std::string
+{
+    if (text.empty())
+        return {};
+    int size = WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0, nullptr, nullptr);
+    std::string result(size, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), result.data(), size, nullptr, nullptr);
+    return result;
+}
+
+inline auto ToWide(const std::string &text) -> std::wstring
+{
+    if (text.empty())
+        return {};
+    int size = MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0);
+    std::wstring result(size, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), result.data(), size);
+    return result;
+}
+
+// Serializes writes from every stream onto stdout so records never interleave.
+class StdoutSink : public OutputSink
+{
+public:
+    void Write(const void *data, size_t size, bool flush) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fwrite(data, 1, size, stdout);
+        if (flush)
+            fflush(stdout);
+    }
+
+private:
+    std::mutex mutex;
+};
 
 class COMInitializer
 {
@@ -44,236 +179,1642 @@ public:
     }
 };
 
-class AudioDeviceManager
+// Registers the calling thread with the MMCSS "Pro Audio" task for as long as
+// the object lives, so the scheduler boosts it ahead of normal-priority work.
+class MmcssRegistration
 {
 public:
-    AudioDeviceManager()
+    explicit MmcssRegistration(AVRT_PRIORITY priority)
     {
-        HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER,
-                                      __uuidof(IMMDeviceEnumerator), reinterpret_cast<void **>(&deviceEnumerator));
-        if (FAILED(hr))
+        DWORD taskIndex = 0;
+        handle = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+        if (!handle)
         {
-            throw std::runtime_error("Failed to create MMDeviceEnumerator instance.");
+            throw std::runtime_error("Failed to register thread with MMCSS.");
         }
 
-        hr = deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
-        if (FAILED(hr))
+        if (!AvSetMmThreadPriority(handle, priority))
         {
-            throw std::runtime_error("Failed to get default audio endpoint.");
+            AvRevertMmThreadCharacteristics(handle);
+            throw std::runtime_error("Failed to set MMCSS thread priority.");
         }
     }
 
-    ~AudioDeviceManager()
+    ~MmcssRegistration()
     {
-        if (device)
-            device->Release();
-        if (deviceEnumerator)
-            deviceEnumerator->Release();
+        AvRevertMmThreadCharacteristics(handle);
     }
 
-    auto CreateAudioClient() -> std::unique_ptr<IAudioClient>
+    MmcssRegistration(const MmcssRegistration &) = delete;
+    MmcssRegistration &operator=(const MmcssRegistration &) = delete;
+
+private:
+    HANDLE handle = nullptr;
+};
+
+// Turns Ctrl+C, Ctrl+Break and console close into a waitable stop request.
+class ConsoleStopSignal
+{
+public:
+    ConsoleStopSignal()
     {
-        IAudioClient *audioClient = nullptr;
-        HRESULT hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, reinterpret_cast<void **>(&audioClient));
-        if (FAILED(hr))
+        stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!stopEvent)
         {
-            throw std::runtime_error("Failed to activate audio client.");
+            throw std::runtime_error("Failed to create stop event.");
         }
 
-        WAVEFORMATEX *waveFormat = nullptr;
-        hr = audioClient->GetMixFormat(&waveFormat);
-        if (FAILED(hr))
+        SetConsoleCtrlHandler(&ConsoleStopSignal::HandlerRoutine, TRUE);
+    }
+
+    ~ConsoleStopSignal()
+    {
+        SetConsoleCtrlHandler(&ConsoleStopSignal::HandlerRoutine, FALSE);
+        CloseHandle(stopEvent);
+        stopEvent = nullptr;
+    }
+
+    void Signal() { SetEvent(stopEvent); }
+
+    void Wait() { WaitForSingleObject(stopEvent, INFINITE); }
+
+    // Returns true once stopped, false when milliseconds pass first.
+    auto WaitFor(DWORD milliseconds) -> bool { return WaitForSingleObject(stopEvent, milliseconds) == WAIT_OBJECT_0; }
+
+private:
+    static BOOL WINAPI HandlerRoutine(DWORD)
+    {
+        SetEvent(stopEvent);
+        return TRUE;
+    }
+
+    static inline HANDLE stopEvent = nullptr;
+};
+
+// -pid and -exclude-pid: capture only what one process tree renders, or
+// everything except it.
+struct ProcessLoopbackTarget
+{
+    DWORD processId = 0;
+    bool includeTree = true;
+};
+
+// Receives the result of ActivateAudioInterfaceAsync. Reference counted for
+// real, since the activation may release it after the waiting thread has moved
+// on, and agile, so it can be called on any thread.
+class ActivationHandler : public IActivateAudioInterfaceCompletionHandler, public IAgileObject
+{
+public:
+    ActivationHandler()
+    {
+        completed = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!completed)
         {
-            audioClient->Release();
-            throw std::runtime_error("Failed to get mix format.");
+            throw std::runtime_error("Failed to create activation event.");
         }
+    }
 
-        hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_LOOPBACK, 0, 0, waveFormat, nullptr);
-        CoTaskMemFree(waveFormat);
+    ActivationHandler(const ActivationHandler &) = delete;
+    ActivationHandler &operator=(const ActivationHandler &) = delete;
 
-        if (FAILED(hr))
+    auto GetCompletedEvent() const -> HANDLE { return completed; }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void **object) override
+    {
+        if (iid == __uuidof(IUnknown) || iid == __uuidof(IActivateAudioInterfaceCompletionHandler))
+            *object = static_cast<IActivateAudioInterfaceCompletionHandler *>(this);
+        else if (iid == __uuidof(IAgileObject))
+            *object = static_cast<IAgileObject *>(this);
+        else
         {
-            audioClient->Release();
-            throw std::runtime_error("Failed to initialize audio client.");
+            *object = nullptr;
+            return E_NOINTERFACE;
         }
+        AddRef();
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++references; }
 
-        return std::unique_ptr<IAudioClient>(audioClient);
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG remaining = --references;
+        if (remaining == 0)
+            delete this;
+        return remaining;
+    }
+
+    HRESULT STDMETHODCALLTYPE ActivateCompleted(IActivateAudioInterfaceAsyncOperation *) override
+    {
+        SetEvent(completed);
+        return S_OK;
     }
 
 private:
-    IMMDeviceEnumerator *deviceEnumerator = nullptr;
-    IMMDevice *device = nullptr;
+    ~ActivationHandler() { CloseHandle(completed); }
+
+    std::atomic<ULONG> references{1};
+    HANDLE completed = nullptr;
 };
 
-class AudioStreamCapture
+struct EndpointInfo
+{
+    std::wstring id;
+    std::wstring friendlyName;
+};
+
+// Also the endpoint notification sink: callbacks arrive on a system thread
+// and only raise a flag and an event that the capture thread picks up.
+class AudioDeviceManager : public IMMNotificationClient
 {
 public:
-    explicit AudioStreamCapture(IAudioClient *audioClient) : audioClient(audioClient)
+    // An empty deviceId opens the default render endpoint and follows it when
+    // the default changes. With a processTarget there is no endpoint: clients
+    // capture that process tree's audio, or everything but it, wherever it plays.
+    explicit AudioDeviceManager(const std::wstring &deviceId = {}, std::optional<ProcessLoopbackTarget> processTarget = {})
+        : requestedId(deviceId), processTarget(processTarget)
     {
-        HRESULT hr = audioClient->GetService(__uuidof(IAudioCaptureClient), reinterpret_cast<void **>(&captureClient));
+        HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER,
+                                      __uuidof(IMMDeviceEnumerator), reinterpret_cast<void **>(&deviceEnumerator));
         if (FAILED(hr))
         {
-            throw std::runtime_error("Failed to get capture client service.");
+            throw std::runtime_error("Failed to create MMDeviceEnumerator instance.");
         }
-    }
 
-    ~AudioStreamCapture()
-    {
-        if (captureClient)
-            captureClient->Release();
+        changeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!changeEvent)
+        {
+            deviceEnumerator->Release();
+            throw std::runtime_error("Failed to create device change event.");
+        }
+
+        try
+        {
+            Reopen();
+        }
+        catch (...)
+        {
+            CloseHandle(changeEvent);
+            deviceEnumerator->Release();
+            throw;
+        }
+
+        hr = deviceEnumerator->RegisterEndpointNotificationCallback(this);
+        if (FAILED(hr))
+        {
+            if (device)
+                device->Release();
+            CloseHandle(changeEvent);
+            deviceEnumerator->Release();
+            throw std::runtime_error("Failed to register device notifications.");
+        }
     }
 
-    void StartCapture(int sampleCount, int interval)
+    AudioDeviceManager(const AudioDeviceManager &) = delete;
+    AudioDeviceManager &operator=(const AudioDeviceManager &) = delete;
+
+    static auto EnumerateRenderEndpoints() -> std::vector<EndpointInfo>
     {
-        audioClient->Start();
+        IMMDeviceEnumerator *enumerator = nullptr;
+        HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER,
+                                      __uuidof(IMMDeviceEnumerator), reinterpret_cast<void **>(&enumerator));
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to create MMDeviceEnumerator instance.");
+        }
 
-        while (isRunning)
+        IMMDeviceCollection *collection = nullptr;
+        hr = enumerator->EnumAudioEndpoints(eRender, DEVICE_STATE_ACTIVE, &collection);
+        enumerator->Release();
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to enumerate audio endpoints.");
+        }
+
+        UINT count = 0;
+        collection->GetCount(&count);
+
+        std::vector<EndpointInfo> endpoints;
+        for (UINT i = 0; i < count; ++i)
         {
-            UINT32 packetLength = 0;
-            captureClient->GetNextPacketSize(&packetLength);
+            IMMDevice *endpoint = nullptr;
+            if (FAILED(collection->Item(i, &endpoint)))
+                continue;
 
-            while (packetLength != 0)
+            EndpointInfo info;
+            LPWSTR id = nullptr;
+            if (SUCCEEDED(endpoint->GetId(&id)))
             {
-                CaptureAndProcess(sampleCount);
-                captureClient->GetNextPacketSize(&packetLength);
-                std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+                info.id = id;
+                CoTaskMemFree(id);
             }
+            info.friendlyName = GetFriendlyName(endpoint);
+            endpoint->Release();
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+            if (!info.id.empty())
+                endpoints.push_back(std::move(info));
         }
 
-        audioClient->Stop();
+        collection->Release();
+        return endpoints;
     }
 
-    void StopCapture() { isRunning = false; }
-
-private:
-    void CaptureAndProcess(int sampleCount)
+    auto GetEndpointInfo() const -> EndpointInfo
     {
-        BYTE *bufferData = nullptr;
-        UINT32 framesAvailable = 0;
-        DWORD flags = 0;
-
-        captureClient->GetBuffer(&bufferData, &framesAvailable, &flags, nullptr, nullptr);
-
-        json outputJson = ProcessAudio(bufferData, framesAvailable, sampleCount);
-
-        std::cout << outputJson.dump(-1) << std::endl;
-
-        captureClient->ReleaseBuffer(framesAvailable);
+        EndpointInfo info;
+        LPWSTR id = nullptr;
+        if (SUCCEEDED(device->GetId(&id)))
+        {
+            info.id = id;
+            CoTaskMemFree(id);
+        }
+        info.friendlyName = GetFriendlyName(device);
+        return info;
     }
 
-    json ProcessAudio(BYTE *bufferData, UINT32 framesAvailable, int maxSamples)
+    ~AudioDeviceManager()
     {
-        int frameCount = static_cast<int>(framesAvailable);
-        int sampleCount = std::min<int>(maxSamples, frameCount * 2);
+        deviceEnumerator->UnregisterEndpointNotificationCallback(this);
+        if (device)
+            device->Release();
+        deviceEnumerator->Release();
+        CloseHandle(changeEvent);
+    }
 
-        std::vector<double> leftSamples(sampleCount / 2);
-        std::vector<double> rightSamples(sampleCount / 2);
+    // Resolves the endpoint again: the current default, or the requested id.
+    void Reopen()
+    {
+        if (processTarget)
+            return;
 
-        for (int i = 0; i < sampleCount / 2; ++i)
+        IMMDevice *endpoint = nullptr;
+        HRESULT hr;
+        if (requestedId.empty())
+            hr = deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &endpoint);
+        else
+            hr = deviceEnumerator->GetDevice(requestedId.c_str(), &endpoint);
+        if (FAILED(hr))
         {
-            float leftSample = *(reinterpret_cast<float *>(bufferData + i * sizeof(float) * 2));
-            float rightSample = *(reinterpret_cast<float *>(bufferData + i * sizeof(float) * 2 + sizeof(float)));
-
-            leftSamples[i] = leftSample;
-            rightSamples[i] = rightSample;
+            throw std::runtime_error(requestedId.empty() ? "Failed to get default audio endpoint." : "Failed to open audio endpoint.");
         }
 
-        ApplyCompression(leftSamples);
-        ApplyCompression(rightSamples);
+        if (device)
+            device->Release();
+        device = endpoint;
 
-        json outputJson;
-        outputJson["leftSamples"] = leftSamples;
-        outputJson["rightSamples"] = rightSamples;
+        std::wstring id;
+        LPWSTR endpointId = nullptr;
+        if (SUCCEEDED(device->GetId(&endpointId)))
+        {
+            id = endpointId;
+            CoTaskMemFree(endpointId);
+        }
 
-        return outputJson;
+        std::lock_guard<std::mutex> lock(idMutex);
+        currentId = std::move(id);
     }
 
-    void ApplyCompression(std::vector<double> &samples)
+    // Signaled whenever ConsumeChange would return true.
+    auto GetChangeEvent() const -> HANDLE { return changeEvent; }
+
+    // True once per notification that the captured endpoint changed or went away.
+    bool ConsumeChange() { return changed.exchange(false); }
+
+    // Fills in streamFormat and periodFrames, the frames of one engine
+    // period, which is how many frames most packets carry.
+    auto CreateAudioClient(CaptureMode mode, REFERENCE_TIME bufferDuration, bool lowLatency, StreamFormat &streamFormat,
+                           UINT32 &periodFrames) -> AudioClientPtr
     {
-        const int N = static_cast<int>(samples.size());
-        if (N == 0)
-            return;
+        if (processTarget)
+            return CreateProcessLoopbackClient(mode, bufferDuration, streamFormat, periodFrames);
 
-        std::vector<std::complex<double>> fftInput(N);
-        std::vector<std::complex<double>> fftOutput(N);
+        IAudioClient *audioClient = nullptr;
+        HRESULT hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, reinterpret_cast<void **>(&audioClient));
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to activate audio client.");
+        }
 
-        for (int i = 0; i < N; ++i)
+        WAVEFORMATEX *waveFormat = nullptr;
+        hr = audioClient->GetMixFormat(&waveFormat);
+        if (FAILED(hr))
         {
-            fftInput[i] = {samples[i], 0.0};
+            audioClient->Release();
+            throw std::runtime_error("Failed to get mix format.");
         }
 
-        fftw_plan forwardPlan = fftw_plan_dft_1d(N, reinterpret_cast<fftw_complex *>(fftInput.data()), reinterpret_cast<fftw_complex *>(fftOutput.data()), FFTW_FORWARD, FFTW_ESTIMATE);
-        fftw_execute(forwardPlan);
-        fftw_destroy_plan(forwardPlan);
+        DWORD streamFlags = AUDCLNT_STREAMFLAGS_LOOPBACK;
+        if (mode == CaptureMode::Event)
+        {
+            streamFlags |= AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+            if (bufferDuration == 0)
+                bufferDuration = CAPTURE_BUFFER_DURATION;
+        }
 
-        const double THRESHOLD = 0.5;
-        const double RATIO = 4.0;
+        try
+        {
+            streamFormat = StreamFormat::FromWaveFormat(waveFormat);
+        }
+        catch (...)
+        {
+            CoTaskMemFree(waveFormat);
+            audioClient->Release();
+            throw;
+        }
 
-        for (auto &frequency : fftOutput)
+        hr = E_FAIL;
+        if (lowLatency)
         {
-            double magnitude = std::abs(frequency);
-            if (magnitude > THRESHOLD)
+            hr = InitializeLowLatency(audioClient, streamFlags, waveFormat, periodFrames);
+            if (FAILED(hr))
             {
-                frequency *= (THRESHOLD + (magnitude - THRESHOLD) / RATIO) / magnitude;
+                std::cerr << "Low-latency shared mode is unavailable; using the default engine period." << std::endl;
+
+                // A client whose initialization failed need not accept
+                // another, so the fallback runs on a fresh one.
+                audioClient->Release();
+                audioClient = nullptr;
+                hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, reinterpret_cast<void **>(&audioClient));
+                if (FAILED(hr))
+                {
+                    CoTaskMemFree(waveFormat);
+                    throw std::runtime_error("Failed to activate audio client.");
+                }
+                hr = E_FAIL;
             }
         }
+        if (FAILED(hr))
+        {
+            hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, streamFlags, bufferDuration, 0, waveFormat, nullptr);
 
-        fftw_plan inversePlan = fftw_plan_dft_1d(N, reinterpret_cast<fftw_complex *>(fftOutput.data()), reinterpret_cast<fftw_complex *>(fftInput.data()), FFTW_BACKWARD, FFTW_ESTIMATE);
-        fftw_execute(inversePlan);
-        fftw_destroy_plan(inversePlan);
+            REFERENCE_TIME defaultPeriod = 0;
+            if (SUCCEEDED(hr) && SUCCEEDED(audioClient->GetDevicePeriod(&defaultPeriod, nullptr)))
+                periodFrames = static_cast<UINT32>(defaultPeriod * streamFormat.sampleRate / 10000000);
+            else
+                periodFrames = 0;
+        }
+        CoTaskMemFree(waveFormat);
 
-        for (int i = 0; i < N; ++i)
+        if (FAILED(hr))
         {
-            samples[i] = fftInput[i].real() / N;
+            audioClient->Release();
+            throw std::runtime_error("Failed to initialize audio client.");
         }
-    }
 
-    IAudioClient *audioClient;
-    IAudioCaptureClient *captureClient = nullptr;
-    bool isRunning = true;
-};
+        return AudioClientPtr(audioClient);
+    }
 
-int main(int argc, char *argv[])
-{
-    try
+    // The virtual process loopback device only hands out clients
+    // asynchronously and reports no mix format, so the stream asks for float
+    // stereo and lets the engine convert. Packets then behave as on an endpoint.
+    auto CreateProcessLoopbackClient(CaptureMode mode, REFERENCE_TIME bufferDuration, StreamFormat &streamFormat,
+                                     UINT32 &periodFrames) -> AudioClientPtr
     {
-        COMInitializer comInit;
+        AUDIOCLIENT_ACTIVATION_PARAMS parameters{};
+        parameters.ActivationType = AUDIOCLIENT_ACTIVATION_TYPE_PROCESS_LOOPBACK;
+        parameters.ProcessLoopbackParams.TargetProcessId = processTarget->processId;
+        parameters.ProcessLoopbackParams.ProcessLoopbackMode = processTarget->includeTree ? PROCESS_LOOPBACK_MODE_INCLUDE_TARGET_PROCESS_TREE
+                                                                                          : PROCESS_LOOPBACK_MODE_EXCLUDE_TARGET_PROCESS_TREE;
 
-        int sampleCount = 64;
-        int intervalDuration = 15;
+        PROPVARIANT activation{};
+        activation.vt = VT_BLOB;
+        activation.blob.cbSize = sizeof(parameters);
+        activation.blob.pBlobData = reinterpret_cast<BYTE *>(&parameters);
 
-        for (int i = 1; i < argc; ++i)
+        auto *handler = new ActivationHandler();
+        IActivateAudioInterfaceAsyncOperation *operation = nullptr;
+        HRESULT hr = ActivateAudioInterfaceAsync(VIRTUAL_AUDIO_DEVICE_PROCESS_LOOPBACK, __uuidof(IAudioClient), &activation, handler, &operation);
+        IUnknown *activated = nullptr;
+        if (SUCCEEDED(hr))
         {
-            if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc)
+            if (WaitForSingleObject(handler->GetCompletedEvent(), PROCESS_ACTIVATION_TIMEOUT_MS) == WAIT_OBJECT_0)
             {
-                sampleCount = atoi(argv[++i]);
-                if (sampleCount <= 0)
-                    throw std::invalid_argument("Sample count must be positive.");
+                HRESULT activateResult = E_FAIL;
+                hr = operation->GetActivateResult(&activateResult, &activated);
+                if (SUCCEEDED(hr))
+                    hr = activateResult;
             }
-            else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+            else
             {
-                intervalDuration = atoi(argv[++i]);
-                if (intervalDuration <= 0)
-                    throw std::invalid_argument("Interval must be positive.");
+                hr = E_FAIL;
             }
+            operation->Release();
         }
+        handler->Release();
 
-        AudioDeviceManager audioManager;
+        IAudioClient *audioClient = nullptr;
+        if (SUCCEEDED(hr))
+            hr = activated->QueryInterface(__uuidof(IAudioClient), reinterpret_cast<void **>(&audioClient));
+        if (activated)
+            activated->Release();
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to activate process loopback client.");
+        }
 
-        auto audioClientPtr = audioManager.CreateAudioClient();
+        WAVEFORMATEX waveFormat{};
+        waveFormat.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+        waveFormat.nChannels = PROCESS_LOOPBACK_CHANNELS;
+        waveFormat.nSamplesPerSec = PROCESS_LOOPBACK_SAMPLE_RATE;
+        waveFormat.wBitsPerSample = 32;
+        waveFormat.nBlockAlign = waveFormat.nChannels * waveFormat.wBitsPerSample / 8;
+        waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+        streamFormat = StreamFormat::FromWaveFormat(&waveFormat);
 
-        AudioStreamCapture streamCapture(audioClientPtr.get());
+        DWORD streamFlags = AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+        if (mode == CaptureMode::Event)
+        {
+            streamFlags |= AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+            if (bufferDuration == 0)
+                bufferDuration = CAPTURE_BUFFER_DURATION;
+        }
 
-#ifdef _DEBUG
-        std::thread captureThread([&]()
-                                  { streamCapture.StartCapture(sampleCount - 1, intervalDuration); });
-#else
-        streamCapture.StartCapture(sampleCount - 1, intervalDuration);
-#endif
+        hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, streamFlags, bufferDuration, 0, &waveFormat, nullptr);
+        if (FAILED(hr))
+        {
+            audioClient->Release();
+            throw std::runtime_error("Failed to initialize process loopback client.");
+        }
+
+        // The virtual device has no period of its own to report.
+        REFERENCE_TIME defaultPeriod = 0;
+        if (SUCCEEDED(audioClient->GetDevicePeriod(&defaultPeriod, nullptr)))
+            periodFrames = static_cast<UINT32>(defaultPeriod * streamFormat.sampleRate / 10000000);
+        else
+            periodFrames = 0;
+
+        return AudioClientPtr(audioClient);
+    }
+
+    // Windows 10 engines can run a shared stream at less than the default
+    // period; the minimum they support is used. The buffer size follows from
+    // the period, so -buffer-ms does not apply.
+    static auto InitializeLowLatency(IAudioClient *audioClient, DWORD streamFlags, const WAVEFORMATEX *waveFormat, UINT32 &periodFrames)
+        -> HRESULT
+    {
+        IAudioClient3 *lowLatencyClient = nullptr;
+        HRESULT hr = audioClient->QueryInterface(__uuidof(IAudioClient3), reinterpret_cast<void **>(&lowLatencyClient));
+        if (FAILED(hr))
+            return hr;
+
+        UINT32 defaultPeriod = 0;
+        UINT32 fundamentalPeriod = 0;
+        UINT32 minimumPeriod = 0;
+        UINT32 maximumPeriod = 0;
+        hr = lowLatencyClient->GetSharedModeEnginePeriod(waveFormat, &defaultPeriod, &fundamentalPeriod, &minimumPeriod, &maximumPeriod);
+        if (SUCCEEDED(hr))
+            hr = lowLatencyClient->InitializeSharedAudioStream(streamFlags, minimumPeriod, waveFormat, nullptr);
+        lowLatencyClient->Release();
+
+        periodFrames = minimumPeriod;
+        return hr;
+    }
+
+    // Lifetime is owned by the caller, not by COM references.
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void **object) override
+    {
+        if (iid == __uuidof(IUnknown) || iid == __uuidof(IMMNotificationClient))
+        {
+            *object = static_cast<IMMNotificationClient *>(this);
+            return S_OK;
+        }
+        *object = nullptr;
+        return E_NOINTERFACE;
+    }
 
-        streamCapture.StopCapture();
+    ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+
+    ULONG STDMETHODCALLTYPE Release() override { return 1; }
+
+    HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR) override
+    {
+        if (requestedId.empty() && !processTarget && flow == eRender && role == eConsole)
+            RaiseChange();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR deviceId, DWORD) override
+    {
+        if (IsCurrentDevice(deviceId))
+            RaiseChange();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR deviceId) override
+    {
+        if (IsCurrentDevice(deviceId))
+            RaiseChange();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR) override { return S_OK; }
+
+    HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR, const PROPERTYKEY) override { return S_OK; }
+
+private:
+    void RaiseChange()
+    {
+        changed = true;
+        SetEvent(changeEvent);
+    }
+
+    bool IsCurrentDevice(LPCWSTR deviceId)
+    {
+        std::lock_guard<std::mutex> lock(idMutex);
+        return deviceId && currentId == deviceId;
+    }
+
+    static auto GetFriendlyName(IMMDevice *endpoint) -> std::wstring
+    {
+        IPropertyStore *properties = nullptr;
+        if (FAILED(endpoint->OpenPropertyStore(STGM_READ, &properties)))
+            return {};
+
+        std::wstring name;
+        PROPVARIANT value;
+        PropVariantInit(&value);
+        if (SUCCEEDED(properties->GetValue(PKEY_Device_FriendlyName, &value)) && value.vt == VT_LPWSTR)
+            name = value.pwszVal;
+        PropVariantClear(&value);
+        properties->Release();
+        return name;
+    }
+
+    IMMDeviceEnumerator *deviceEnumerator = nullptr;
+    IMMDevice *device = nullptr;
+    std::wstring requestedId;
+    std::optional<ProcessLoopbackTarget> processTarget;
+    std::mutex idMutex;
+    std::wstring currentId;
+    HANDLE changeEvent = nullptr;
+    std::atomic<bool> changed{false};
+};
+
+// Single-producer/single-consumer ring of preallocated slots. The producer
+// fills the slot returned by BeginWrite and publishes it with CommitWrite; the
+// consumer does the same with BeginRead/CommitRead. Neither side blocks.
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    template <typename Fn>
+    void ForEachSlot(Fn fn)
+    {
+        for (auto &slot : slots)
+            fn(slot);
+    }
+
+    auto BeginWrite() -> T *
+    {
+        size_t head = writeIndex.load(std::memory_order_relaxed);
+        if (head - readIndex.load(std::memory_order_acquire) == slots.size())
+            return nullptr;
+        return &slots[head & mask];
+    }
+
+    void CommitWrite() { writeIndex.store(writeIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    auto BeginRead() -> T *
+    {
+        size_t tail = readIndex.load(std::memory_order_relaxed);
+        if (tail == writeIndex.load(std::memory_order_acquire))
+            return nullptr;
+        return &slots[tail & mask];
+    }
+
+    void CommitRead() { readIndex.store(readIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    auto Size() const -> size_t { return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire); }
+
+    auto Capacity() const -> size_t { return slots.size(); }
+
+private:
+    std::vector<T> slots;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> writeIndex{0};
+    alignas(64) std::atomic<size_t> readIndex{0};
+};
+
+class AudioStreamCapture
+{
+public:
+    // The stream opens its own client on device and rebuilds it there when the
+    // endpoint changes. planCache and sink may be shared with other streams. A
+    // negative streamId leaves output untagged, as for a single endpoint.
+    AudioStreamCapture(AudioDeviceManager &device, const CaptureOptions &options, FFTPlanCache &planCache, OutputSink &sink,
+                       int streamId = -1)
+        : device(device), mode(options.mode), bufferDuration(options.bufferDuration), lowLatency(options.lowLatency), useMmcss(options.useMmcss), mmcssPriority(options.mmcssPriority), streamId(streamId),
+          processor(options, planCache, sink, streamId), ring(options.ringCapacity)
+    {
+#ifdef GETDESKTOPAUDIO_STATS
+        processor.AttachStats(&stats);
+#endif
+
+        packetReady = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!packetReady)
+        {
+            throw std::runtime_error("Failed to create processing event.");
+        }
+
+        if (mode == CaptureMode::Event)
+        {
+            bufferEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+            if (!bufferEvent)
+            {
+                CloseHandle(packetReady);
+                throw std::runtime_error("Failed to create capture event.");
+            }
+        }
+
+        try
+        {
+            Connect();
+        }
+        catch (...)
+        {
+            if (bufferEvent)
+                CloseHandle(bufferEvent);
+            CloseHandle(packetReady);
+            throw;
+        }
+    }
+
+    ~AudioStreamCapture()
+    {
+        captureClient.reset();
+        audioClient.reset();
+        if (bufferEvent)
+            CloseHandle(bufferEvent);
+        if (packetReady)
+            CloseHandle(packetReady);
+    }
+
+    // Blocks the calling thread, which becomes the capture thread, until
+    // StopCapture is called. The processing thread is owned and joined here.
+    // A lost or changed endpoint ends one session: the processing thread
+    // drains the ring and exits, the client is rebuilt and a new session starts.
+    void StartCapture(int sampleCount, int interval)
+    {
+        std::unique_ptr<MmcssRegistration> mmcss;
+        if (useMmcss)
+            mmcss = std::make_unique<MmcssRegistration>(mmcssPriority);
+
+        while (true)
+        {
+            isProcessing = true;
+            std::thread processingThread([this, sampleCount]()
+                                         { ProcessPackets(sampleCount); });
+
+            bool reconnect = false;
+            try
+            {
+                reconnect = RunCaptureLoop(interval);
+            }
+            catch (...)
+            {
+                isProcessing = false;
+                SetEvent(packetReady);
+                processingThread.join();
+                throw;
+            }
+
+            isProcessing = false;
+            SetEvent(packetReady);
+            processingThread.join();
+
+            if (!reconnect || !isRunning)
+                break;
+            Reconnect(sampleCount);
+            if (!isRunning)
+                break;
+        }
+    }
+
+    void StopCapture() { isRunning = false; }
+
+    auto GetRingOccupancy() const -> size_t { return ring.Size(); }
+
+    auto GetRingCapacity() const -> size_t { return ring.Capacity(); }
+
+    auto GetOverrunCount() const -> uint64_t { return overruns.load(std::memory_order_relaxed); }
+
+    auto GetReconnectCount() const -> uint64_t { return reconnects.load(std::memory_order_relaxed); }
+
+    // Packets WASAPI flagged with AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY.
+    auto GetDiscontinuityCount() const -> uint64_t { return discontinuities.load(std::memory_order_relaxed); }
+
+    // Jumps in device position between queued packets, from either the engine
+    // or a full ring, and the frames they skipped.
+    auto GetGapCount() const -> uint64_t { return gaps.load(std::memory_order_relaxed); }
+
+    auto GetGapFrameCount() const -> uint64_t { return gapFrames.load(std::memory_order_relaxed); }
+
+    void PreparePlans(int maxSamples) { processor.PreparePlans(maxSamples, periodFrames); }
+
+    // Every packet from now on is also written to recorder, before it is
+    // processed. Must be called before StartCapture.
+    void AttachRecorder(CaptureFileWriter &recorder)
+    {
+        this->recorder = &recorder;
+        recorder.WriteFormat(streamFormat);
+    }
+
+    // The processing thread reports on stderr how long after startedAt the
+    // first packet was written.
+    void ReportFirstPacket(std::chrono::steady_clock::time_point startedAt)
+    {
+        this->startedAt = startedAt;
+        reportFirstPacket = true;
+    }
+
+    auto GetOutputRate() const -> double { return processor.GetOutputRate(); }
+
+    auto GetDecimationFactor() const -> int { return processor.GetDecimationFactor(); }
+
+#ifdef GETDESKTOPAUDIO_STATS
+    auto GetStats() -> StreamStats & { return stats; }
+#endif
+
+private:
+    // Opens a client on the manager's current endpoint and sizes every
+    // format-dependent buffer for it. Plans and the output sink are kept.
+    void Connect()
+    {
+        audioClient = device.CreateAudioClient(mode, bufferDuration, lowLatency, streamFormat, periodFrames);
+
+        IAudioCaptureClient *client = nullptr;
+        HRESULT hr = audioClient->GetService(__uuidof(IAudioCaptureClient), reinterpret_cast<void **>(&client));
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to get capture client service.");
+        }
+        captureClient.reset(client);
+
+        UINT32 bufferFrames = 0;
+        hr = audioClient->GetBufferSize(&bufferFrames);
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to get capture buffer size.");
+        }
+
+        if (bufferEvent)
+        {
+            hr = audioClient->SetEventHandle(bufferEvent);
+            if (FAILED(hr))
+            {
+                throw std::runtime_error("Failed to set capture event handle.");
+            }
+        }
+
+        // No single packet can exceed the engine buffer, so sizing every slot
+        // for it keeps the capture thread free of allocations.
+        ring.ForEachSlot([&](CapturedPacket &packet)
+                         { packet.data.resize(static_cast<size_t>(bufferFrames) * streamFormat.bytesPerFrame); });
+
+        processor.Configure(streamFormat, bufferFrames);
+        if (recorder)
+            recorder->WriteFormat(streamFormat);
+
+        // A new client restarts its device position at zero.
+        hasExpectedPosition = false;
+    }
+
+    // Runs between sessions, so nothing else touches the stream state. Retries
+    // until an endpoint is available again or StopCapture is called.
+    void Reconnect(int sampleCount)
+    {
+        auto lostAt = std::chrono::steady_clock::now();
+        captureClient.reset();
+        audioClient.reset();
+
+        while (isRunning)
+        {
+            device.ConsumeChange();
+            try
+            {
+                device.Reopen();
+                Connect();
+                PreparePlans(sampleCount);
+
+                auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lostAt);
+                reconnects.fetch_add(1, std::memory_order_relaxed);
+                std::cerr << "Reconnected" << (streamId >= 0 ? " stream " + std::to_string(streamId) : std::string())
+                          << " in " << latency.count() << " ms." << std::endl;
+                return;
+            }
+            catch (const std::runtime_error &)
+            {
+                captureClient.reset();
+                audioClient.reset();
+            }
+
+            WaitForSingleObject(device.GetChangeEvent(), RECONNECT_RETRY_MS);
+        }
+    }
+
+    // Returns true when the session ended because the endpoint was lost or
+    // changed, false once StopCapture was called.
+    auto RunCaptureLoop(int interval) -> bool
+    {
+        HRESULT hr = audioClient->Start();
+        if (IsDeviceLost(hr))
+            return true;
+        if (FAILED(hr))
+        {
+            throw std::runtime_error("Failed to start audio client.");
+        }
+
+        const HANDLE waitHandles[] = {bufferEvent, device.GetChangeEvent()};
+        bool reconnect = false;
+
+        while (isRunning)
+        {
+            if (mode == CaptureMode::Event)
+            {
+                STATS_TICKS(waitStart);
+                WaitForMultipleObjects(2, waitHandles, FALSE, CAPTURE_EVENT_TIMEOUT_MS);
+                STATS_RECORD(&stats, StatsStage::CaptureWait, waitStart);
+            }
+
+            if (device.ConsumeChange())
+            {
+                reconnect = true;
+                break;
+            }
+
+            hr = DrainPackets();
+            if (IsDeviceLost(hr))
+            {
+                reconnect = true;
+                break;
+            }
+            if (FAILED(hr))
+            {
+                audioClient->Stop();
+                throw std::runtime_error("Failed to read capture packet.");
+            }
+
+            if (mode == CaptureMode::Polling)
+                WaitForSingleObject(device.GetChangeEvent(), interval);
+        }
+
+        audioClient->Stop();
+        return reconnect;
+    }
+
+    auto DrainPackets() -> HRESULT
+    {
+        UINT32 packetLength = 0;
+        HRESULT hr = captureClient->GetNextPacketSize(&packetLength);
+
+        while (SUCCEEDED(hr) && packetLength != 0)
+        {
+            hr = CapturePacket();
+            if (SUCCEEDED(hr))
+                hr = captureClient->GetNextPacketSize(&packetLength);
+        }
+        return hr;
+    }
+
+    // Runs on the capture thread: copy the packet into the ring and hand the
+    // buffer straight back to WASAPI. A full ring drops the packet.
+    auto CapturePacket() -> HRESULT
+    {
+        BYTE *bufferData = nullptr;
+        UINT32 framesAvailable = 0;
+        DWORD flags = 0;
+        UINT64 devicePosition = 0;
+        UINT64 qpcPosition = 0;
+
+        STATS_TICKS(getBufferStart);
+        HRESULT hr = captureClient->GetBuffer(&bufferData, &framesAvailable, &flags, &devicePosition, &qpcPosition);
+        if (FAILED(hr))
+            return hr;
+
+        if (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+            discontinuities.fetch_add(1, std::memory_order_relaxed);
+
+        CapturedPacket *packet = ring.BeginWrite();
+        if (packet)
+        {
+            // Measured against the last queued packet, so frames lost to a
+            // full ring show up as a gap on the next one.
+            UINT64 gap = 0;
+            if (hasExpectedPosition && devicePosition > expectedPosition)
+                gap = devicePosition - expectedPosition;
+            if (gap > 0)
+            {
+                gaps.fetch_add(1, std::memory_order_relaxed);
+                gapFrames.fetch_add(gap, std::memory_order_relaxed);
+            }
+            expectedPosition = devicePosition + framesAvailable;
+            hasExpectedPosition = true;
+
+            const size_t bytesPerFrame = streamFormat.bytesPerFrame;
+            size_t byteCount = std::min(static_cast<size_t>(framesAvailable) * bytesPerFrame, packet->data.size());
+            std::memcpy(packet->data.data(), bufferData, byteCount);
+            packet->frameCount = static_cast<UINT32>(byteCount / bytesPerFrame);
+            packet->flags = flags;
+            packet->devicePosition = devicePosition;
+            packet->qpcPosition = qpcPosition;
+            packet->gapFrames = gap;
+            ring.CommitWrite();
+        }
+        else
+        {
+            overruns.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        hr = captureClient->ReleaseBuffer(framesAvailable);
+        STATS_RECORD(&stats, StatsStage::GetBuffer, getBufferStart);
+
+        if (packet)
+            SetEvent(packetReady);
+        return hr;
+    }
+
+    // Runs on the processing thread: compress and serialize every queued packet
+    // until the session ends.
+    void ProcessPackets(int sampleCount)
+    {
+        while (true)
+        {
+            while (CapturedPacket *packet = ring.BeginRead())
+            {
+#ifdef _DEBUG
+                uint64_t allocationsBefore = AllocationCounter::count;
+#endif
+                if (recorder)
+                    recorder->WritePacket(*packet);
+                processor.Process(*packet, sampleCount);
+                if (reportFirstPacket)
+                {
+                    reportFirstPacket = false;
+                    auto latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startedAt);
+                    std::cerr << (streamId >= 0 ? "stream " + std::to_string(streamId) + ": " : std::string()) << "first packet after "
+                              << latency.count() << " ms" << std::endl;
+                }
+#ifdef GETDESKTOPAUDIO_STATS
+                stats.packets.fetch_add(1, std::memory_order_relaxed);
+                stats.frames.fetch_add(packet->frameCount, std::memory_order_relaxed);
+#endif
+                ring.CommitRead();
+#ifdef _DEBUG
+                CheckSteadyStateAllocations(AllocationCounter::count - allocationsBefore);
+#endif
+            }
+
+            if (!isProcessing)
+                break;
+
+            WaitForSingleObject(packetReady, PROCESSING_WAIT_TIMEOUT_MS);
+        }
+        processor.Flush();
+    }
+
+#ifdef _DEBUG
+    void CheckSteadyStateAllocations(uint64_t allocations)
+    {
+        if (++processedPackets <= ALLOCATION_WARMUP_PACKETS || allocations == 0)
+            return;
+
+        if (steadyStateAllocations == 0)
+            std::cerr << "Processing path allocated " << allocations << " times after warm-up." << std::endl;
+        steadyStateAllocations += allocations;
+    }
+#endif
+
+    AudioDeviceManager &device;
+    AudioClientPtr audioClient;
+    CaptureClientPtr captureClient;
+    StreamFormat streamFormat{};
+    CaptureMode mode;
+    REFERENCE_TIME bufferDuration;
+    bool lowLatency;
+    bool useMmcss;
+    AVRT_PRIORITY mmcssPriority;
+    HANDLE bufferEvent = nullptr;
+    HANDLE packetReady = nullptr;
+    int streamId;
+    PacketProcessor processor;
+    SpscRing<CapturedPacket> ring;
+    std::atomic<uint64_t> overruns{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> discontinuities{0};
+    std::atomic<uint64_t> gaps{0};
+    std::atomic<uint64_t> gapFrames{0};
+    UINT64 expectedPosition = 0;
+    bool hasExpectedPosition = false;
+    UINT32 periodFrames = 0;
+    CaptureFileWriter *recorder = nullptr;
+    std::chrono::steady_clock::time_point startedAt;
+    bool reportFirstPacket = false; // touched by the processing thread once it runs
+#ifdef _DEBUG
+    uint64_t processedPackets = 0;
+    uint64_t steadyStateAllocations = 0;
+#endif
+#ifdef GETDESKTOPAUDIO_STATS
+    StreamStats stats;
+#endif
+    std::atomic<bool> isRunning{true};
+    std::atomic<bool> isProcessing{false};
+};
+
+#ifdef GETDESKTOPAUDIO_STATS
+// Appends one report block for a stream; rates cover the seconds since the
+// previous report, which also drained the histograms.
+void FormatStreamStats(AudioStreamCapture &capture, int streamId, double seconds, std::string &report)
+{
+    StreamStats &stats = capture.GetStats();
+    uint64_t packets = stats.packets.exchange(0, std::memory_order_relaxed);
+    uint64_t frames = stats.frames.exchange(0, std::memory_order_relaxed);
+
+    report += std::format("{}{:.1f} packets/s, {:.1f} frames/s, ring {}/{}, {} overruns, {} gaps ({} frames), {} discontinuities\n",
+                          streamId >= 0 ? std::format("stream {}: ", streamId) : std::string(), packets / seconds, frames / seconds,
+                          capture.GetRingOccupancy(), capture.GetRingCapacity(), capture.GetOverrunCount(), capture.GetGapCount(),
+                          capture.GetGapFrameCount(), capture.GetDiscontinuityCount());
+    FormatStageStats(stats, report);
+}
+#endif
+
+// Packets replayed at full speed between checks for Ctrl+C.
+constexpr uint64_t REPLAY_STOP_CHECK_PACKETS = 64;
+
+// -replay: feeds a -record file through a processor and sink just like live
+// capture, on the calling thread. Real-time pacing holds every packet until
+// its recorded QPC position comes round; otherwise packets go through as fast
+// as the processor takes them.
+void ReplayCapture(const std::string &path, const ProcessingOptions &options, FFTPlanCache &planCache, OutputSink &sink,
+                   int sampleCount, bool realTime, ConsoleStopSignal &stopSignal)
+{
+    CaptureFileReader reader(path);
+    PacketProcessor processor(options, planCache, sink);
+
+    CapturedPacket packet;
+    CaptureFileReader::Record record;
+    bool hasFirstPacket = false;
+    UINT64 firstQpcPosition = 0;
+    uint64_t packets = 0;
+    uint64_t frames = 0;
+    double recordedSeconds = 0.0;
+    DWORD sampleRate = 0;
+    auto startedAt = std::chrono::steady_clock::now();
+
+    while (reader.Next(record))
+    {
+        if (record.kind == CaptureRecordKind::Format)
+        {
+            processor.Flush();
+            processor.Configure(record.format, reader.GetMaxPacketFrames());
+            processor.PreparePlans(sampleCount);
+            packet.data.resize(static_cast<size_t>(reader.GetMaxPacketFrames()) * record.format.bytesPerFrame);
+            sampleRate = record.format.sampleRate;
+            continue;
+        }
+
+        if (realTime)
+        {
+            if (!hasFirstPacket)
+            {
+                firstQpcPosition = record.header.qpcPosition;
+                hasFirstPacket = true;
+                startedAt = std::chrono::steady_clock::now();
+            }
+            auto due = startedAt + std::chrono::microseconds((record.header.qpcPosition - firstQpcPosition) / 10);
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+            if (stopSignal.WaitFor(static_cast<DWORD>(std::max<int64_t>(wait.count(), 0))))
+                break;
+        }
+        else if (packets % REPLAY_STOP_CHECK_PACKETS == 0 && stopSignal.WaitFor(0))
+        {
+            break;
+        }
+
+        packet.frameCount = record.header.frameCount;
+        packet.flags = record.header.flags;
+        packet.devicePosition = record.header.devicePosition;
+        packet.qpcPosition = record.header.qpcPosition;
+        packet.gapFrames = record.header.gapFrames;
+        std::memcpy(packet.data.data(), record.data, record.header.size);
+
+        processor.Process(packet, sampleCount);
+        ++packets;
+        frames += packet.frameCount;
+        recordedSeconds += static_cast<double>(packet.frameCount) / sampleRate;
+    }
+    processor.Flush();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startedAt).count();
+    std::cerr << "Replayed " << packets << " packets (" << frames << " frames) in " << seconds * 1000.0 << " ms, "
+              << (seconds > 0.0 ? recordedSeconds / seconds : 0.0) << "x real time." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        auto startedAt = std::chrono::steady_clock::now();
+        COMInitializer comInit;
+        auto comReadyAt = std::chrono::steady_clock::now();
+
+        int sampleCount = 64;
+        bool sampleCountSet = false;
+        bool stftWindowSet = false;
+        int intervalDuration = 15;
+        CaptureOptions options;
+        SimdLevel simdLevel = DetectSimdLevel();
+        std::string deviceSelection;
+        std::optional<ProcessLoopbackTarget> processTarget;
+        std::string recordPath;
+        std::string replayPath;
+        bool replayRealTime = true;
+        std::string outputSelection = "stdout";
+        int batchMs = 0;
+        std::string wisdomPath;
+        bool reportTiming = false;
+#ifdef GETDESKTOPAUDIO_STATS
+        int statsInterval = 0;
+#endif
+
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc)
+            {
+                sampleCount = atoi(argv[++i]);
+                if (sampleCount <= 0)
+                    throw std::invalid_argument("Sample count must be positive.");
+                sampleCountSet = true;
+            }
+            else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+            {
+                intervalDuration = atoi(argv[++i]);
+                if (intervalDuration <= 0)
+                    throw std::invalid_argument("Interval must be positive.");
+                options.mode = CaptureMode::Polling;
+            }
+            else if (strcmp(argv[i], "-planner") == 0 && i + 1 < argc)
+            {
+                const char *planner = argv[++i];
+                if (strcmp(planner, "estimate") == 0)
+                    options.plannerFlags = FFTW_ESTIMATE;
+                else if (strcmp(planner, "measure") == 0)
+                    options.plannerFlags = FFTW_MEASURE;
+                else if (strcmp(planner, "patient") == 0)
+                    options.plannerFlags = FFTW_PATIENT;
+                else
+                    throw std::invalid_argument("Planner must be estimate, measure or patient.");
+            }
+            else if (strcmp(argv[i], "-format") == 0 && i + 1 < argc)
+            {
+                const char *name = argv[++i];
+                if (strcmp(name, "json") == 0)
+                    options.format = OutputFormat::Json;
+                else if (strcmp(name, "binary") == 0)
+                    options.format = OutputFormat::Binary;
+                else if (strcmp(name, "packed") == 0)
+                    options.format = OutputFormat::Packed;
+                else
+                    throw std::invalid_argument("Format must be json, binary or packed.");
+            }
+            else if (strcmp(argv[i], "-json-precision") == 0 && i + 1 < argc)
+            {
+                options.jsonPrecision = atoi(argv[++i]);
+                if (options.jsonPrecision <= 0 || options.jsonPrecision > JsonWriter::MAX_FIXED_PRECISION)
+                    throw std::invalid_argument("JSON precision must be between 1 and 17 decimals.");
+            }
+            else if (strcmp(argv[i], "-packed-batch") == 0 && i + 1 < argc)
+            {
+                options.packedBatch = atoi(argv[++i]);
+                if (options.packedBatch <= 0 || options.packedBatch > UINT16_MAX)
+                    throw std::invalid_argument("Packed batch must be between 1 and 65535 packets.");
+            }
+            else if (strcmp(argv[i], "-ring") == 0 && i + 1 < argc)
+            {
+                int ringCapacity = atoi(argv[++i]);
+                if (ringCapacity <= 0)
+                    throw std::invalid_argument("Ring capacity must be positive.");
+                options.ringCapacity = static_cast<size_t>(ringCapacity);
+            }
+            else if (strcmp(argv[i], "-buffer-ms") == 0 && i + 1 < argc)
+            {
+                // Shared-mode buffer duration in ms; REFERENCE_TIME counts 100 ns.
+                int bufferMs = atoi(argv[++i]);
+                if (bufferMs <= 0)
+                    throw std::invalid_argument("Buffer duration must be positive.");
+                options.bufferDuration = static_cast<REFERENCE_TIME>(bufferMs) * 10000;
+            }
+            else if (strcmp(argv[i], "-low-latency") == 0)
+            {
+                options.lowLatency = true;
+            }
+            else if (strcmp(argv[i], "-mmcss") == 0 && i + 1 < argc)
+            {
+                const char *priority = argv[++i];
+                if (strcmp(priority, "low") == 0)
+                    options.mmcssPriority = AVRT_PRIORITY_LOW;
+                else if (strcmp(priority, "normal") == 0)
+                    options.mmcssPriority = AVRT_PRIORITY_NORMAL;
+                else if (strcmp(priority, "high") == 0)
+                    options.mmcssPriority = AVRT_PRIORITY_HIGH;
+                else if (strcmp(priority, "critical") == 0)
+                    options.mmcssPriority = AVRT_PRIORITY_CRITICAL;
+                else
+                    throw std::invalid_argument("MMCSS priority must be low, normal, high or critical.");
+                options.useMmcss = true;
+            }
+            else if (strcmp(argv[i], "-simd") == 0 && i + 1 < argc)
+            {
+                const char *level = argv[++i];
+                if (strcmp(level, "auto") == 0)
+                    simdLevel = DetectSimdLevel();
+                else if (strcmp(level, "avx2") == 0)
+                    simdLevel = SimdLevel::Avx2;
+                else if (strcmp(level, "sse2") == 0)
+                    simdLevel = SimdLevel::Sse2;
+                else if (strcmp(level, "scalar") == 0)
+                    simdLevel = SimdLevel::Scalar;
+                else
+                    throw std::invalid_argument("SIMD level must be auto, avx2, sse2 or scalar.");
+            }
+            else if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc)
+            {
+                options.compressor.threshold = atof(argv[++i]);
+                if (options.compressor.threshold <= 0.0)
+                    throw std::invalid_argument("Threshold must be positive.");
+            }
+            else if (strcmp(argv[i], "-ratio") == 0 && i + 1 < argc)
+            {
+                options.compressor.ratio = atof(argv[++i]);
+                if (options.compressor.ratio < 1.0)
+                    throw std::invalid_argument("Ratio must be at least 1.");
+            }
+            else if (strcmp(argv[i], "-attack") == 0 && i + 1 < argc)
+            {
+                options.compressor.attackMs = atof(argv[++i]);
+                if (options.compressor.attackMs < 0.0)
+                    throw std::invalid_argument("Attack must not be negative.");
+            }
+            else if (strcmp(argv[i], "-release") == 0 && i + 1 < argc)
+            {
+                options.compressor.releaseMs = atof(argv[++i]);
+                if (options.compressor.releaseMs < 0.0)
+                    throw std::invalid_argument("Release must not be negative.");
+            }
+            else if (strcmp(argv[i], "-band") == 0 && i + 1 < argc)
+            {
+                // <upper frequency in Hz>:<threshold>, repeatable.
+                CompressorBand band{};
+                if (sscanf(argv[++i], "%lf:%lf", &band.upperFrequency, &band.threshold) != 2 || band.upperFrequency <= 0.0 ||
+                    band.threshold <= 0.0)
+                    throw std::invalid_argument("Band must be <frequency>:<threshold> with both positive.");
+                options.compressor.bands.push_back(band);
+            }
+            else if (strcmp(argv[i], "-spectrum") == 0 && i + 1 < argc)
+            {
+                const char *spectrum = argv[++i];
+                if (strncmp(spectrum, "bands:", 6) == 0)
+                    options.spectrumLayout = SpectrumLayout::Bands;
+                else if (strncmp(spectrum, "bins:", 5) == 0)
+                    options.spectrumLayout = SpectrumLayout::Bins;
+                else
+                    throw std::invalid_argument("Spectrum must be bands:<count> or bins:<count>.");
+                options.spectrumCount = atoi(strchr(spectrum, ':') + 1);
+                if (options.spectrumCount <= 0)
+                    throw std::invalid_argument("Spectrum count must be positive.");
+            }
+            else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+            {
+                options.workerCount = atoi(argv[++i]);
+                if (options.workerCount < 0)
+                    throw std::invalid_argument("Worker count must not be negative.");
+            }
+            else if (strcmp(argv[i], "-worker-cpus") == 0 && i + 1 < argc)
+            {
+                // Comma-separated CPU indices, assigned to workers round robin.
+                options.workerCpus.clear();
+                for (const char *cursor = argv[++i]; *cursor;)
+                {
+                    char *end = nullptr;
+                    long cpu = strtol(cursor, &end, 10);
+                    if (end == cursor || cpu < 0 || cpu >= 64 || cpu >= static_cast<long>(std::thread::hardware_concurrency()))
+                        throw std::invalid_argument("Worker CPUs must be a comma-separated list of available CPU indices.");
+                    options.workerCpus.push_back(static_cast<int>(cpu));
+                    cursor = *end == ',' ? end + 1 : end;
+                }
+            }
+            else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc)
+            {
+                options.outputRate = atoi(argv[++i]);
+                if (options.outputRate <= 0)
+                    throw std::invalid_argument("Output rate must be positive.");
+            }
+            else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc)
+            {
+                outputSelection = argv[++i];
+                if (outputSelection != "stdout" && !outputSelection.starts_with("shm:") && !outputSelection.starts_with("pipe:"))
+                    throw std::invalid_argument("Output must be stdout, shm:<name> or pipe:<name>.");
+                if (outputSelection.size() == outputSelection.find(':') + 1)
+                    throw std::invalid_argument("Output name must not be empty.");
+            }
+            else if (strcmp(argv[i], "-wisdom") == 0 && i + 1 < argc)
+            {
+                wisdomPath = argv[++i];
+            }
+            else if (strcmp(argv[i], "-timing") == 0)
+            {
+                reportTiming = true;
+            }
+            else if (strcmp(argv[i], "-batch-ms") == 0 && i + 1 < argc)
+            {
+                batchMs = atoi(argv[++i]);
+                if (batchMs <= 0)
+                    throw std::invalid_argument("Batch window must be positive.");
+            }
+            else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc)
+            {
+                deviceSelection = argv[++i];
+            }
+            else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+            {
+                recordPath = argv[++i];
+            }
+            else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+            {
+                replayPath = argv[++i];
+            }
+            else if (strcmp(argv[i], "-replay-pace") == 0 && i + 1 < argc)
+            {
+                const char *pace = argv[++i];
+                if (strcmp(pace, "realtime") == 0)
+                    replayRealTime = true;
+                else if (strcmp(pace, "max") == 0)
+                    replayRealTime = false;
+                else
+                    throw std::invalid_argument("Replay pace must be realtime or max.");
+            }
+            else if ((strcmp(argv[i], "-pid") == 0 || strcmp(argv[i], "-exclude-pid") == 0) && i + 1 < argc)
+            {
+                bool includeTree = strcmp(argv[i], "-pid") == 0;
+                long processId = atol(argv[++i]);
+                if (processId <= 0)
+                    throw std::invalid_argument("Process id must be positive.");
+                processTarget = ProcessLoopbackTarget{static_cast<DWORD>(processId), includeTree};
+            }
+            else if (strcmp(argv[i], "-stft") == 0 && i + 1 < argc)
+            {
+                options.stftFrameSize = atoi(argv[++i]);
+                if (options.stftFrameSize <= 0)
+                    throw std::invalid_argument("STFT frame size must be positive.");
+            }
+            else if (strcmp(argv[i], "-hop") == 0 && i + 1 < argc)
+            {
+                options.stftHop = atoi(argv[++i]);
+                if (options.stftHop <= 0)
+                    throw std::invalid_argument("STFT hop must be positive.");
+            }
+            else if (strcmp(argv[i], "-window") == 0 && i + 1 < argc)
+            {
+                const char *window = argv[++i];
+                if (strcmp(window, "hann") == 0)
+                    options.stftWindow = StftWindow::Hann;
+                else if (strcmp(window, "sqrthann") == 0)
+                    options.stftWindow = StftWindow::SqrtHann;
+                else
+                    throw std::invalid_argument("Window must be hann or sqrthann.");
+                stftWindowSet = true;
+            }
+            else if (strcmp(argv[i], "-silence") == 0 && i + 1 < argc)
+            {
+                const char *silence = argv[++i];
+                if (strcmp(silence, "full") == 0)
+                    options.silenceOutput = SilenceOutput::Full;
+                else if (strcmp(silence, "record") == 0)
+                    options.silenceOutput = SilenceOutput::Record;
+                else if (strcmp(silence, "skip") == 0)
+                    options.silenceOutput = SilenceOutput::Skip;
+                else
+                    throw std::invalid_argument("Silence must be full, record or skip.");
+            }
+            else if (strcmp(argv[i], "-noise-floor") == 0 && i + 1 < argc)
+            {
+                // In dBFS, so -96 treats anything below 16-bit resolution as silence.
+                const char *text = argv[++i];
+                char *end = nullptr;
+                double decibels = strtod(text, &end);
+                if (end == text || *end != '\0')
+                    throw std::invalid_argument("Noise floor must be a number of dBFS.");
+                if (!(decibels <= 0.0))
+                    throw std::invalid_argument("Noise floor must be at most 0 dBFS.");
+                options.noiseFloor = std::pow(10.0, decibels / 20.0);
+            }
+            else if (strcmp(argv[i], "-stats") == 0 && i + 1 < argc)
+            {
+#ifdef GETDESKTOPAUDIO_STATS
+                statsInterval = atoi(argv[++i]);
+                if (statsInterval <= 0)
+                    throw std::invalid_argument("Stats interval must be positive.");
+#else
+                throw std::invalid_argument("Stats require a build with GETDESKTOPAUDIO_STATS.");
+#endif
+            }
+        }
+
+        if (simdLevel > DetectSimdLevel())
+            throw std::invalid_argument("Requested SIMD level is not supported by this CPU.");
+        options.simdLevel = simdLevel;
+
+        std::sort(options.compressor.bands.begin(), options.compressor.bands.end(),
+                  [](const CompressorBand &a, const CompressorBand &b) { return a.upperFrequency < b.upperFrequency; });
+
+        if (options.format != OutputFormat::Json && outputSelection == "stdout")
+        {
+            _setmode(_fileno(stdout), _O_BINARY);
+            setvbuf(stdout, nullptr, _IOFBF, BINARY_STDOUT_BUFFER_SIZE);
+        }
+        if (batchMs > 0 && outputSelection == "stdout")
+        {
+            // Room for a whole batch, so the CRT does not split it into buffer-sized writes.
+            setvbuf(stdout, nullptr, _IOFBF, BATCH_CAPACITY);
+        }
+
+        // STFT frames cover every sample of a packet, so -samples has nothing to limit.
+        if (options.stftFrameSize > 0 && sampleCountSet)
+            throw std::invalid_argument("-samples cannot be combined with -stft.");
+        if (options.stftFrameSize == 0 && (options.stftHop > 0 || stftWindowSet))
+            throw std::invalid_argument("-hop and -window require -stft.");
+        if (processTarget && !deviceSelection.empty())
+            throw std::invalid_argument("-pid and -exclude-pid cannot be combined with -device.");
+        if (!replayPath.empty() && (processTarget || !deviceSelection.empty() || !recordPath.empty()))
+            throw std::invalid_argument("-replay cannot be combined with -device, -pid or -record.");
+        if (!recordPath.empty() && deviceSelection == "all")
+            throw std::invalid_argument("-record captures a single stream and cannot be combined with -device all.");
+
+        std::vector<std::wstring> deviceIds;
+        bool tagStreams = deviceSelection == "all";
+        if (tagStreams)
+        {
+            for (const auto &endpoint : AudioDeviceManager::EnumerateRenderEndpoints())
+                deviceIds.push_back(endpoint.id);
+            if (deviceIds.empty())
+                throw std::runtime_error("No active render endpoints.");
+        }
+        else
+        {
+            deviceIds.push_back(ToWide(deviceSelection));
+        }
+
+        // Loaded before any stream plans; missing wisdom just means planning
+        // from scratch, after which the file is written for next time.
+        bool wisdomLoaded = !wisdomPath.empty() && FFTPlanCache::ImportWisdom(wisdomPath);
+
+        FFTPlanCache planCache(options.plannerFlags);
+        std::unique_ptr<OutputSink> sink;
+        if (outputSelection.starts_with("shm:"))
+            sink = std::make_unique<SharedMemorySink>(ToWide(outputSelection.substr(4)));
+        else if (outputSelection.starts_with("pipe:"))
+            sink = std::make_unique<PipeSink>(ToWide(outputSelection.substr(5)));
+        else
+            sink = std::make_unique<StdoutSink>();
+        if (batchMs > 0)
+            sink = std::make_unique<BatchingSink>(std::move(sink), batchMs);
+
+        if (!replayPath.empty())
+        {
+            ConsoleStopSignal stopSignal;
+            ReplayCapture(replayPath, options, planCache, *sink, sampleCount - 1, replayRealTime, stopSignal);
+            sink.reset();
+            fflush(stdout);
+            if (!wisdomPath.empty() && !FFTPlanCache::ExportWisdom(wisdomPath))
+                std::cerr << "Failed to save FFTW wisdom." << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        std::unique_ptr<CaptureFileWriter> recorder;
+        if (!recordPath.empty())
+            recorder = std::make_unique<CaptureFileWriter>(recordPath);
+
+        struct Stream
+        {
+            std::unique_ptr<AudioDeviceManager> device;
+            std::unique_ptr<AudioStreamCapture> capture;
+            std::exception_ptr error;
+        };
+
+        std::chrono::steady_clock::duration activationTime{};
+        std::chrono::steady_clock::duration planningTime{};
+        std::vector<Stream> streams(deviceIds.size());
+        for (size_t i = 0; i < deviceIds.size(); ++i)
+        {
+            Stream &stream = streams[i];
+            auto activationStart = std::chrono::steady_clock::now();
+            stream.device = std::make_unique<AudioDeviceManager>(deviceIds[i], processTarget);
+
+            int streamId = tagStreams ? static_cast<int>(i) : -1;
+            stream.capture = std::make_unique<AudioStreamCapture>(*stream.device, options, planCache, *sink, streamId);
+            if (recorder)
+                stream.capture->AttachRecorder(*recorder);
+            auto planningStart = std::chrono::steady_clock::now();
+            stream.capture->PreparePlans(sampleCount - 1);
+            activationTime += planningStart - activationStart;
+            planningTime += std::chrono::steady_clock::now() - planningStart;
+            if (reportTiming)
+                stream.capture->ReportFirstPacket(startedAt);
+
+            if (tagStreams)
+            {
+                EndpointInfo info = stream.device->GetEndpointInfo();
+                std::cerr << "stream " << i << ": " << ToUtf8(info.friendlyName) << " " << ToUtf8(info.id) << std::endl;
+            }
+            if (stream.capture->GetDecimationFactor() > 1)
+            {
+                std::cerr << (tagStreams ? "stream " + std::to_string(i) + ": " : std::string()) << "decimating by "
+                          << stream.capture->GetDecimationFactor() << " to " << stream.capture->GetOutputRate() << " Hz" << std::endl;
+            }
+        }
+
+        if (!wisdomPath.empty() && !FFTPlanCache::ExportWisdom(wisdomPath))
+            std::cerr << "Failed to save FFTW wisdom." << std::endl;
+
+        if (reportTiming)
+        {
+            using Milliseconds = std::chrono::duration<double, std::milli>;
+            std::cerr << "startup: com " << Milliseconds(comReadyAt - startedAt).count() << " ms, devices "
+                      << Milliseconds(activationTime).count() << " ms, plans " << Milliseconds(planningTime).count() << " ms"
+                      << (wisdomPath.empty() ? "" : wisdomLoaded ? " with wisdom" : " without wisdom") << ", ready after "
+                      << Milliseconds(std::chrono::steady_clock::now() - startedAt).count() << " ms" << std::endl;
+        }
+
+        ConsoleStopSignal stopSignal;
+
+        std::vector<std::thread> captureThreads;
+        for (Stream &stream : streams)
+        {
+            captureThreads.emplace_back([&]()
+                                        {
+                try
+                {
+                    stream.capture->StartCapture(sampleCount - 1, intervalDuration);
+                }
+                catch (...)
+                {
+                    stream.error = std::current_exception();
+                }
+                stopSignal.Signal(); });
+        }
+
+#ifdef GETDESKTOPAUDIO_STATS
+        if (statsInterval > 0)
+        {
+            // Each report goes out in one write so it stays intact on a shared stderr.
+            std::string report;
+            auto reportedAt = std::chrono::steady_clock::now();
+            while (!stopSignal.WaitFor(static_cast<DWORD>(statsInterval)))
+            {
+                auto now = std::chrono::steady_clock::now();
+                double seconds = std::chrono::duration<double>(now - reportedAt).count();
+                reportedAt = now;
+
+                report.clear();
+                for (size_t i = 0; i < streams.size(); ++i)
+                    FormatStreamStats(*streams[i].capture, tagStreams ? static_cast<int>(i) : -1, seconds, report);
+                fwrite(report.data(), 1, report.size(), stderr);
+            }
+        }
+#endif
+        stopSignal.Wait();
+        for (Stream &stream : streams)
+            stream.capture->StopCapture();
+        for (auto &thread : captureThreads)
+            thread.join();
+
+        fflush(stdout);
+
+        // Again for plans that a reconnect to another format added.
+        if (!wisdomPath.empty() && !FFTPlanCache::ExportWisdom(wisdomPath))
+            std::cerr << "Failed to save FFTW wisdom." << std::endl;
+
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            const AudioStreamCapture &capture = *streams[i].capture;
+            std::cerr << (tagStreams ? "stream " + std::to_string(i) + ": " : std::string()) << capture.GetDiscontinuityCount()
+                      << " discontinuities, " << capture.GetGapCount() << " gaps (" << capture.GetGapFrameCount() << " frames), "
+                      << capture.GetOverrunCount() << " overruns, " << capture.GetReconnectCount() << " reconnects" << std::endl;
+        }
+
+        for (Stream &stream : streams)
+        {
+            if (stream.error)
+                std::rethrow_exception(stream.error);
+        }
     }
     catch (const std::exception &e)
     {
@@ -0,0 +1,444 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "dsp.h"
+
+// WriteGrisu2 calls into nlohmann::detail::dtoa_impl, which is not public API,
+// and its digit loop mirrors grisu2_digit_gen as of this release. Recheck both
+// against dump() before moving the json submodule.
+static_assert(NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR == 11 && NLOHMANN_JSON_VERSION_PATCH == 2,
+              "JsonWriter's number formatting was matched against nlohmann::json 3.11.2.");
+
+// Formats JSON records straight into a reusable buffer, with no tree in
+// between. With the default precision the bytes are those nlohmann::json's
+// dump() wrote for the same record, provided the caller writes keys in sorted
+// order as its std::map did: no spaces, floats in their round-trip form and
+// non-finite values as null. A fixed precision instead writes every float with
+// that many decimals, which is shorter for typical samples but no longer
+// round-trips.
+class JsonWriter
+{
+public:
+    // Enough for any integer or round-trip float; larger fixed forms fall back.
+    static constexpr size_t MAX_NUMBER_CHARS = 32;
+    static constexpr int MAX_FIXED_PRECISION = 17;
+
+    explicit JsonWriter(int precision = 0) : precision(precision) {}
+
+    // Grows the buffer to hold at least bytes, so records up to that size are
+    // written without allocating.
+    void Reserve(size_t bytes)
+    {
+        if (buffer.size() < bytes)
+            buffer.resize(bytes);
+    }
+
+    void Clear() { size = 0; }
+
+    auto Data() const -> const char * { return buffer.data(); }
+
+    auto Size() const -> size_t { return size; }
+
+    void BeginObject()
+    {
+        Separate();
+        Put('{');
+    }
+
+    void EndObject() { Put('}'); }
+
+    void BeginArray()
+    {
+        Separate();
+        Put('[');
+    }
+
+    void EndArray() { Put(']'); }
+
+    // Keys are plain ASCII names and are written without escaping.
+    void Key(std::string_view key)
+    {
+        Separate();
+        Ensure(key.size() + 3);
+        char *out = buffer.data() + size;
+        *out++ = '"';
+        std::memcpy(out, key.data(), key.size());
+        out += key.size();
+        *out++ = '"';
+        *out++ = ':';
+        size = out - buffer.data();
+        afterKey = true;
+    }
+
+    void Bool(bool value)
+    {
+        Separate();
+        if (value)
+            Append("true", 4);
+        else
+            Append("false", 5);
+    }
+
+    template <typename T>
+    void Integer(T value)
+    {
+        Separate();
+        Ensure(MAX_NUMBER_CHARS);
+        size = std::to_chars(buffer.data() + size, buffer.data() + size + MAX_NUMBER_CHARS, value).ptr - buffer.data();
+    }
+
+    void Number(Sample value)
+    {
+        Separate();
+        Ensure(MAX_NUMBER_CHARS);
+        size = WriteNumber(buffer.data() + size, value) - buffer.data();
+    }
+
+    // Where Numbers put an array in the record, so Repeat can copy it.
+    struct Span
+    {
+        size_t offset = 0;
+        size_t size = 0;
+    };
+
+    // The whole array in one pass, with room made once for all of it.
+    auto Numbers(const Sample *values, size_t count) -> Span
+    {
+        Separate();
+        Ensure(count * (MAX_NUMBER_CHARS + 1) + 2);
+        char *out = buffer.data() + size;
+        *out++ = '[';
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (i > 0)
+                *out++ = ',';
+            out = WriteNumber(out, values[i]);
+        }
+        *out++ = ']';
+        const size_t start = size;
+        size = out - buffer.data();
+        return {start, size - start};
+    }
+
+    // Writes a value this record already holds again, without formatting it
+    // a second time.
+    void Repeat(Span span)
+    {
+        Separate();
+        Ensure(span.size);
+        std::memcpy(buffer.data() + size, buffer.data() + span.offset, span.size);
+        size += span.size;
+    }
+
+    void EndLine() { Put('\n'); }
+
+private:
+    // A comma goes before every value but the first in an object or array,
+    // which is exactly every value not right after '{', '[' or a key.
+    void Separate()
+    {
+        if (afterKey)
+        {
+            afterKey = false;
+            return;
+        }
+        if (size > 0 && buffer[size - 1] != '{' && buffer[size - 1] != '[')
+            Put(',');
+    }
+
+    void Ensure(size_t bytes)
+    {
+        if (size + bytes > buffer.size())
+            buffer.resize(std::max(size + bytes, buffer.size() * 2));
+    }
+
+    void Put(char character)
+    {
+        Ensure(1);
+        buffer[size++] = character;
+    }
+
+    void Append(const char *text, size_t length)
+    {
+        Ensure(length);
+        std::memcpy(buffer.data() + size, text, length);
+        size += length;
+    }
+
+    auto WriteNumber(char *out, Sample value) const -> char *
+    {
+        if (!std::isfinite(value))
+        {
+            std::memcpy(out, "null", 4);
+            return out + 4;
+        }
+        if (precision > 0)
+        {
+            if (char *end = WriteFixedFast(out, value))
+                return end;
+            // Magnitudes too large for the fast form go through std::to_chars,
+            // and those too long even for MAX_NUMBER_CHARS to the shortest form.
+            auto result = std::to_chars(out, out + MAX_NUMBER_CHARS, value, std::chars_format::fixed, precision);
+            if (result.ec == std::errc())
+                return result.ptr;
+        }
+        // dump()'s own Grisu2 digits. std::to_chars finds shorter ones for a
+        // few values in a thousand, which would change those bytes.
+        return WriteGrisu2(out, value);
+    }
+
+    struct Product
+    {
+        uint64_t low;
+        uint64_t high;
+    };
+
+    static auto Multiply(uint64_t a, uint64_t b) -> Product
+    {
+#if defined(__SIZEOF_INT128__)
+        const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return {static_cast<uint64_t>(product), static_cast<uint64_t>(product >> 64)};
+#elif defined(_M_X64)
+        Product product;
+        product.low = _umul128(a, b, &product.high);
+        return product;
+#else
+        const uint64_t aLow = a & 0xFFFFFFFFu, aHigh = a >> 32, bLow = b & 0xFFFFFFFFu, bHigh = b >> 32;
+        const uint64_t middle = (aLow * bLow >> 32) + (aLow * bHigh & 0xFFFFFFFFu) + (aHigh * bLow & 0xFFFFFFFFu);
+        return {a * b, aHigh * bHigh + (aLow * bHigh >> 32) + (aHigh * bLow >> 32) + (middle >> 32)};
+#endif
+    }
+
+    // Two decimal digits per entry, for writing digits in pairs.
+    static constexpr char DIGIT_PAIRS[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                          "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                          "8081828384858687888990919293949596979899";
+
+    // The count digits of value, which has no more than that, ending at end.
+    static void WriteDigits(char *end, uint32_t value, int count)
+    {
+        for (; count >= 2; count -= 2, value /= 100)
+        {
+            end -= 2;
+            std::memcpy(end, DIGIT_PAIRS + 2 * (value % 100), 2);
+        }
+        if (count > 0)
+            end[-1] = static_cast<char>('0' + value % 10);
+    }
+
+    // nlohmann::detail::to_chars, digit for digit. The boundaries, the cached
+    // power of ten and the products are its own; the digit loop takes eight
+    // fractional digits per step and the final rounding is computed rather
+    // than stepped, which together halve the time per float.
+    template <typename Float>
+    static auto WriteGrisu2(char *out, Float value) -> char *
+    {
+        namespace dtoa = nlohmann::detail::dtoa_impl;
+        using Bits = std::conditional_t<sizeof(Float) == 4, uint32_t, uint64_t>;
+        constexpr int PRECISION = std::numeric_limits<Float>::digits;
+        constexpr int BIAS = std::numeric_limits<Float>::max_exponent - 1 + (PRECISION - 1);
+        constexpr uint64_t HIDDEN_BIT = uint64_t(1) << (PRECISION - 1);
+        constexpr Bits SIGN_BIT = Bits(1) << (sizeof(Bits) * 8 - 1);
+
+        // Signs come in at random, so the minus is written either way.
+        Bits bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        *out = '-';
+        out += bits >> (sizeof(Bits) * 8 - 1);
+        bits &= ~SIGN_BIT;
+        if (bits == 0)
+        {
+            std::memcpy(out, "0.0", 3);
+            return out + 3;
+        }
+
+        // compute_boundaries, with the normalizing loops as one shift each.
+        const uint64_t biased = bits >> (PRECISION - 1);
+        const uint64_t fraction = bits & (HIDDEN_BIT - 1);
+        uint64_t v = biased == 0 ? fraction : fraction + HIDDEN_BIT;
+        const int exponent = biased == 0 ? 1 - BIAS : static_cast<int>(biased) - BIAS;
+        const bool lowerCloser = fraction == 0 && biased > 1;
+        uint64_t plus = 2 * v + 1;
+        uint64_t minus = lowerCloser ? 4 * v - 1 : 2 * v - 1;
+        const int plusShift = std::countl_zero(plus);
+        plus <<= plusShift;
+        minus <<= plusShift - (lowerCloser ? 1 : 0);
+        v <<= std::countl_zero(v);
+
+        // grisu2: the product rounds as diyfp::mul does, ties up.
+        const auto cached = dtoa::get_cached_power_for_binary_exponent(exponent - 1 - plusShift);
+        auto scale = [&](uint64_t x)
+        {
+            const Product product = Multiply(x, cached.f);
+            return product.high + (product.low >> 63);
+        };
+        const uint64_t w = scale(v);
+        const uint64_t low = scale(minus) + 1;
+        const uint64_t high = scale(plus) - 1;
+        const int shift = -(exponent - 1 - plusShift + cached.e + 64);
+        const uint64_t one = uint64_t(1) << shift;
+
+        // grisu2_digit_gen.
+        char digits[48];
+        int length = 0;
+        int decimalExponent = -cached.k;
+        uint64_t delta = high - low;
+        uint64_t dist = high - w;
+        uint32_t integral = static_cast<uint32_t>(high >> shift);
+        uint64_t rest = high & (one - 1);
+        uint32_t pow10;
+        const int integralDigits = dtoa::find_largest_pow10(integral, pow10);
+        if (rest > delta)
+        {
+            // The remainder never drops to delta before the fraction, so every
+            // integral digit goes out.
+            WriteDigits(digits + integralDigits, integral, integralDigits);
+            length = integralDigits;
+        }
+        else
+        {
+            for (int n = integralDigits; n > 0;)
+            {
+                digits[length++] = static_cast<char>('0' + integral / pow10);
+                integral %= pow10;
+                --n;
+                const uint64_t remainder = (uint64_t{integral} << shift) + rest;
+                if (remainder <= delta)
+                {
+                    dtoa::grisu2_round(digits, length, dist, delta, remainder, uint64_t{pow10} << shift);
+                    return dtoa::format_buffer(CopyDigits(out, digits, length), length, decimalExponent + n, -4,
+                                               std::numeric_limits<Float>::digits10);
+                }
+                pow10 /= 10;
+            }
+        }
+
+        // Digit by digit, generation stops after j digits of a chunk once
+        // (chunk mod 10^(8-j)) * 2^shift + next <= delta * 10^8. The left side
+        // only shrinks as j grows, so the first j is a count of failing j.
+        constexpr uint64_t CHUNK = 100000000;
+        for (;;)
+        {
+            const Product product = Multiply(rest, CHUNK);
+            const uint32_t chunk = static_cast<uint32_t>(product.high << (64 - shift) | product.low >> shift);
+            const uint64_t next = product.low & (one - 1);
+            const Product limit = Multiply(delta, CHUNK);
+            WriteDigits(digits + length + 4, chunk / 10000, 4);
+            WriteDigits(digits + length + 8, chunk % 10000, 4);
+            if (limit.high == 0 && next > limit.low)
+            {
+                length += 8;
+                decimalExponent -= 8;
+                rest = next;
+                delta *= CHUNK;
+                dist *= CHUNK;
+                continue;
+            }
+
+            const uint64_t slack = (limit.high << (64 - shift)) | ((limit.low - next) >> shift);
+            const uint64_t spare = slack - (limit.low < next ? uint64_t(1) << (64 - shift) : 0);
+            const int count = 1 + (chunk % 10000000 > spare) + (chunk % 1000000 > spare) + (chunk % 100000 > spare) +
+                              (chunk % 10000 > spare) + (chunk % 1000 > spare) + (chunk % 100 > spare) + (chunk % 10 > spare);
+            static constexpr uint64_t POWERS_OF_TEN[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+            length += count;
+            decimalExponent -= count;
+            rest = rest * POWERS_OF_TEN[count] & (one - 1);
+            delta *= POWERS_OF_TEN[count];
+            dist *= POWERS_OF_TEN[count];
+            break;
+        }
+
+        // grisu2_round steps the last digit down while rest + 2^shift stays
+        // within delta and rest + 2^(shift-1) below dist. Both only get
+        // harder, so the number of steps is the smaller of two quotients.
+        const uint64_t withinDelta = (delta - rest) >> shift;
+        const uint64_t closerToW = rest < dist ? (dist - rest + (one >> 1) - 1) >> shift : 0;
+        digits[length - 1] = static_cast<char>(digits[length - 1] - std::min(withinDelta, closerToW));
+
+        return FormatDigits(out, digits, length, decimalExponent, std::numeric_limits<Float>::digits10);
+    }
+
+    static auto CopyDigits(char *out, const char *digits, int length) -> char *
+    {
+        std::memcpy(out, digits, length);
+        return out;
+    }
+
+    // format_buffer for digits * 10^decimalExponent, with fixed-size copies
+    // for the plain forms; exponent forms go to format_buffer itself.
+    static auto FormatDigits(char *out, const char *digits, int length, int decimalExponent, int maxExponent) -> char *
+    {
+        constexpr size_t MAX_DIGITS = 17;
+        const int point = length + decimalExponent;
+        if (length <= point && point <= maxExponent)
+        {
+            std::memcpy(out, digits, MAX_DIGITS);
+            std::memset(out + length, '0', point - length);
+            std::memcpy(out + point, ".0", 2);
+            return out + point + 2;
+        }
+        if (0 < point && point <= maxExponent)
+        {
+            std::memcpy(out, digits, point);
+            out[point] = '.';
+            std::memcpy(out + point + 1, digits + point, length - point);
+            return out + length + 1;
+        }
+        if (-4 < point && point <= 0)
+        {
+            std::memcpy(out, "0.0000", 6);
+            std::memcpy(out + 2 - point, digits, MAX_DIGITS);
+            return out + 2 - point + length;
+        }
+        return nlohmann::detail::dtoa_impl::format_buffer(CopyDigits(out, digits, length), length, decimalExponent, -4, maxExponent);
+    }
+
+    // The fixed form through one multiply and integer digits, byte for byte as
+    // std::to_chars writes it. Below FIXED_FAST_LIMIT the product is off from
+    // the exact one by under 1e-6, so it rounds the same way unless it lies
+    // that close to a tie; those, and larger values, return null.
+    auto WriteFixedFast(char *out, Sample value) const -> char *
+    {
+        static constexpr double POWERS_OF_TEN[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                                                   1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+        static constexpr double FIXED_FAST_LIMIT = 4294967296.0;
+        static constexpr double TIE_MARGIN = 1e-6;
+
+        const double scaled = std::abs(static_cast<double>(value)) * POWERS_OF_TEN[precision];
+        if (!(scaled < FIXED_FAST_LIMIT))
+            return nullptr;
+        const double rounded = std::nearbyint(scaled);
+        if (std::abs(std::abs(scaled - rounded) - 0.5) < TIE_MARGIN)
+            return nullptr;
+
+        uint64_t digits = static_cast<uint64_t>(rounded);
+        const uint64_t unit = static_cast<uint64_t>(POWERS_OF_TEN[precision]);
+        if (std::signbit(value))
+            *out++ = '-';
+        out = std::to_chars(out, out + MAX_NUMBER_CHARS, digits / unit).ptr;
+        *out = '.';
+        digits %= unit;
+        for (int i = precision; i > 0; --i)
+        {
+            out[i] = static_cast<char>('0' + digits % 10);
+            digits /= 10;
+        }
+        return out + precision + 1;
+    }
+
+    int precision;
+    std::vector<char> buffer;
+    size_t size = 0;
+    bool afterKey = false;
+};
@@ -0,0 +1,779 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <audioclient.h>
+
+#include "codec.h"
+#include "dsp.h"
+#include "jsonwriter.h"
+#include "stats.h"
+#include "workers.h"
+
+enum class OutputFormat
+{
+    Json,
+    Binary,
+    Packed
+};
+
+// What a silent packet turns into: the usual samples (zeros, without running
+// the DSP), one compact silence record, or nothing at all.
+enum class SilenceOutput
+{
+    Full,
+    Record,
+    Skip
+};
+
+// Everything that shapes how packets are decoded, compressed and written.
+struct ProcessingOptions
+{
+    unsigned plannerFlags = FFTW_ESTIMATE;
+    OutputFormat format = OutputFormat::Json;
+    int packedBatch = PACKED_DEFAULT_BATCH; // packets per -format packed frame
+    SimdLevel simdLevel = SimdLevel::Scalar;
+    int stftFrameSize = 0; // 0 compresses each packet with one transform
+    int stftHop = 0;       // 0 means half the frame
+    StftWindow stftWindow = StftWindow::Hann;
+    SilenceOutput silenceOutput = SilenceOutput::Full;
+    double noiseFloor = 0.0; // linear peak at or below which a packet counts as silent
+    CompressorConfig compressor;
+    SpectrumLayout spectrumLayout = SpectrumLayout::None; // None writes samples
+    int spectrumCount = 0;
+    int workerCount = 0;         // threads besides the processing thread for channel blocks
+    std::vector<int> workerCpus; // CPUs the workers are pinned to, round robin
+    int outputRate = 0;          // 0 keeps the mix rate; else decimates by mix rate / outputRate
+    int jsonPrecision = 0;       // decimals per JSON float; 0 writes them as dump() did
+};
+
+// Binary output is a stream of frames, each this header followed by
+// frameCount * channelCount interleaved float32 samples. All fields are
+// little-endian; qpcPosition is GetBuffer's QPC position in 100 ns units,
+// devicePosition its stream position in frames, flags the raw buffer flags and
+// gapFrames the frames missing before this one. streamId tells endpoints apart
+// when several are captured at once. With BINARY_FLAG_SILENCE set the header
+// stands for frameCount frames of silence and no samples follow.
+#pragma pack(push, 1)
+struct BinaryFrameHeader
+{
+    uint32_t magic;
+    uint64_t sequence;
+    uint64_t qpcPosition;
+    uint64_t devicePosition;
+    uint16_t streamId;
+    uint16_t channelCount;
+    uint16_t flags;
+    uint32_t gapFrames;
+    uint32_t frameCount;
+};
+#pragma pack(pop)
+
+constexpr uint32_t BINARY_FRAME_MAGIC = 0x46414447; // "GDAF"
+
+// Above the AUDCLNT_BUFFERFLAGS_* bits passed through in BinaryFrameHeader::flags.
+constexpr uint16_t BINARY_FLAG_SILENCE = 0x8000;
+static_assert(BINARY_FLAG_SILENCE == PACKED_FLAG_SILENCE, "Packed frames flag silence as binary frames do.");
+
+// The frame carries spectrum values instead of samples: frameCount values per
+// channel, interleaved by channel like samples.
+constexpr uint16_t BINARY_FLAG_SPECTRUM = 0x4000;
+
+struct CapturedPacket
+{
+    std::vector<BYTE> data;
+    UINT32 frameCount = 0;
+    DWORD flags = 0;
+    UINT64 devicePosition = 0;
+    UINT64 qpcPosition = 0;
+    UINT64 gapFrames = 0;
+};
+
+// Destination for finished records. Write may be called from several
+// processing threads at once; flush marks the end of a text record.
+class OutputSink
+{
+public:
+    virtual ~OutputSink() = default;
+
+    virtual void Write(const void *data, size_t size, bool flush) = 0;
+};
+
+// Turns captured packets into output records: decode, compress, serialize.
+// It holds no device state, so the benchmark drives it with synthetic or
+// recorded packets exactly as the capture path does.
+class PacketProcessor
+{
+public:
+    // planCache and sink may be shared with other processors. A negative
+    // streamId leaves output untagged, as for a single endpoint.
+    PacketProcessor(const ProcessingOptions &options, FFTPlanCache &planCache, OutputSink &sink, int streamId = -1)
+        : kernels(SimdKernels::ForLevel(options.simdLevel)), decimator(kernels.firDot), compressor(options.compressor, kernels.gainLookup),
+          format(options.format), silenceOutput(options.silenceOutput), noiseFloor(static_cast<Sample>(options.noiseFloor)),
+          spectrumLayout(options.spectrumLayout), spectrumAnalyzer(options.spectrumLayout, options.spectrumCount),
+          outputRate(options.outputRate), packedBatch(options.packedBatch), plannerFlags(options.plannerFlags), planCache(planCache), sink(sink), streamId(streamId),
+          jsonWriter(options.jsonPrecision)
+    {
+        if (spectrumLayout != SpectrumLayout::None && options.stftFrameSize > 0)
+        {
+            throw std::invalid_argument("Spectrum output cannot be combined with -stft.");
+        }
+        if (spectrumLayout != SpectrumLayout::None && format == OutputFormat::Packed)
+        {
+            throw std::invalid_argument("Spectrum output cannot be combined with -format packed.");
+        }
+
+        if (options.stftFrameSize > 0)
+        {
+            int hop = options.stftHop > 0 ? options.stftHop : options.stftFrameSize / 2;
+            stftConfig = std::make_unique<StftConfig>(options.stftFrameSize, hop, options.stftWindow);
+        }
+
+        if (options.workerCount > 0)
+            workerPool = std::make_unique<WorkerPool>(options.workerCount, options.workerCpus);
+    }
+
+    PacketProcessor(const PacketProcessor &) = delete;
+    PacketProcessor &operator=(const PacketProcessor &) = delete;
+
+    // Sizes every format-dependent buffer for packets of up to bufferFrames
+    // frames. Called again whenever the stream format changes.
+    void Configure(const StreamFormat &streamFormat, UINT32 bufferFrames)
+    {
+        this->streamFormat = streamFormat;
+        deinterleave = SelectDeinterleave(streamFormat, kernels);
+
+        // Decimation runs at integer factors only; a rate that does not
+        // divide the mix rate gets the nearest rate above it.
+        const int factor = outputRate > 0 ? std::max<int>(1, streamFormat.sampleRate / outputRate) : 1;
+        decimator.Configure(factor, streamFormat.channelCount, bufferFrames);
+        processingRate = static_cast<double>(streamFormat.sampleRate) / factor;
+
+        channels.resize(streamFormat.channelCount);
+        for (auto &channel : channels)
+            channel.reserve(bufferFrames);
+        channelPointers.resize(streamFormat.channelCount);
+        framePointers.resize(streamFormat.channelCount);
+        interleaved.reserve(static_cast<size_t>(bufferFrames) * streamFormat.channelCount);
+        spectra.resize(streamFormat.channelCount);
+        for (auto &spectrum : spectra)
+            spectrum.reserve(bufferFrames / 2 + 1);
+        if (format == OutputFormat::Packed)
+            packedEncoder.Configure(streamFormat.channelCount, bufferFrames, packedBatch);
+
+        if (stftConfig)
+            stft = std::make_unique<StftProcessor>(*stftConfig, streamFormat.channelCount);
+        silentFrames = 0;
+        stftBypassed = false;
+
+        int maxTransformSize = std::max<int>(bufferFrames, stftConfig ? stftConfig->frameSize : 0);
+        workspace = std::make_unique<FFTWorkspace>(maxTransformSize, streamFormat.channelCount);
+        compressor.Reserve(maxTransformSize, streamFormat.channelCount);
+
+        // As many blocks as threads, each a contiguous run of channels.
+        channelBlocks.clear();
+        if (workerPool && streamFormat.channelCount > 1)
+        {
+            const int blockCount = std::min(workerPool->Size(), streamFormat.channelCount);
+            for (int block = 0; block < blockCount; ++block)
+            {
+                int first = block * streamFormat.channelCount / blockCount;
+                int count = (block + 1) * streamFormat.channelCount / blockCount - first;
+                channelBlocks.push_back({first, count, std::make_unique<FFTPlanCache>(plannerFlags),
+                                         std::make_unique<FFTWorkspace>(maxTransformSize, count)});
+            }
+        }
+
+        // Left, right and every channel again, each sized for its longest
+        // numbers; the writer grows on its own if this is short.
+        if (format == OutputFormat::Json)
+            jsonWriter.Reserve((static_cast<size_t>(bufferFrames) * (JsonWriter::MAX_NUMBER_CHARS + 1) + 2) * (streamFormat.channelCount + 2) + 512);
+    }
+
+#ifdef GETDESKTOPAUDIO_STATS
+    // Stage timings go to stats from now on; null stops recording.
+    void AttachStats(StreamStats *stats) { this->stats = stats; }
+#endif
+
+    // The rate of the samples after decimation, which every record carries.
+    auto GetOutputRate() const -> double { return processingRate; }
+
+    auto GetDecimationFactor() const -> int { return decimator.Factor(); }
+
+    // The samples of the last packet ProcessAudio finished, one vector per
+    // channel, for the benchmark's reference serializer.
+    auto GetChannels() const -> const std::vector<std::vector<Sample>> & { return channels; }
+
+    // Plans the packet sizes known up front: the -samples cap and, when it
+    // is shorter, packetFrames decimated, the engine period most packets
+    // arrive in.
+    void PreparePlans(int maxSamples, UINT32 packetFrames = 0)
+    {
+        if (stftConfig)
+        {
+            PreparePlan(stftConfig->frameSize);
+            return;
+        }
+
+        PreparePlan(maxSamples / 2);
+        if (packetFrames > 0)
+            PreparePacketPlans(static_cast<int>(packetFrames), maxSamples / 2);
+    }
+
+    // Decodes, compresses and writes one packet.
+    void Process(const CapturedPacket &packet, int sampleCount)
+    {
+        bool silent = ProcessAudio(packet, sampleCount);
+        WriteRecord(packet, silent);
+    }
+
+    // ProcessAudio and WriteRecord are the two stages of Process, public so
+    // the benchmark can time them separately.
+    void WriteRecord(const CapturedPacket &packet, bool silent)
+    {
+        if (silent && silenceOutput == SilenceOutput::Skip)
+            return;
+
+        if (format == OutputFormat::Packed)
+        {
+            WritePacked(packet, silent && silenceOutput == SilenceOutput::Record);
+        }
+        else if (silent && silenceOutput == SilenceOutput::Record)
+        {
+            if (format == OutputFormat::Binary)
+                WriteBinarySilence(packet);
+            else
+                WriteJsonSilence(packet);
+        }
+        else if (format == OutputFormat::Binary)
+        {
+            WriteBinaryFrame(packet);
+        }
+        else
+        {
+            WriteJson(packet);
+        }
+    }
+
+    // Writes out a partly filled packed frame. Called when a session ends, so
+    // the last packets are not held back.
+    void Flush()
+    {
+        if (format == OutputFormat::Packed && !packedEncoder.IsEmpty())
+            WritePackedFrame();
+    }
+
+    // Returns true when the packet was silent and the DSP was skipped. Silence
+    // is the SILENT flag or a peak at or below the noise floor; the STFT is
+    // only bypassed once its history and overlap hold nothing but silence.
+    auto ProcessAudio(const CapturedPacket &packet, int maxSamples) -> bool
+    {
+        // -samples counts stereo samples, so it caps each channel at half. The
+        // cap applies after decimation, whose filter needs every frame, and
+        // the STFT stage needs the stream without gaps and takes every frame.
+        const size_t frameCap = stftConfig ? packet.frameCount : static_cast<size_t>(maxSamples / 2);
+        size_t frameCount = decimator.Factor() > 1 ? packet.frameCount : std::min<size_t>(frameCap, packet.frameCount);
+
+        for (size_t channel = 0; channel < channels.size(); ++channel)
+        {
+            channels[channel].resize(frameCount);
+            channelPointers[channel] = channels[channel].data();
+        }
+
+        bool silent;
+        if (packet.flags & AUDCLNT_BUFFERFLAGS_SILENT)
+        {
+            // The buffer contents are undefined, so never read them. Silence
+            // that is written out still goes through the decimator so its
+            // filter state stays continuous.
+            if (silenceOutput == SilenceOutput::Full || stftConfig)
+            {
+                for (auto &channel : channels)
+                    std::fill(channel.begin(), channel.end(), Sample(0));
+                frameCount = Decimate(frameCount, frameCap);
+            }
+            else
+            {
+                frameCount = std::min(frameCap, decimator.Skip(frameCount));
+                ResizeChannels(frameCount);
+            }
+            silent = true;
+        }
+        else
+        {
+            STATS_TICKS(deinterleaveStart);
+            Sample peak = deinterleave(packet.data.data(), frameCount, streamFormat.channelCount, channelPointers.data());
+            STATS_RECORD(stats, StatsStage::Deinterleave, deinterleaveStart);
+            frameCount = Decimate(frameCount, frameCap);
+            silent = peak <= noiseFloor;
+        }
+
+        if (!silent)
+        {
+            silentFrames = 0;
+        }
+        else if (stftConfig)
+        {
+            // Frames already in the STFT bypass it once frameSize + hop silent
+            // frames have followed them in.
+            size_t drained = static_cast<size_t>(stftConfig->frameSize + stftConfig->hop);
+            bool bypass = silentFrames >= drained;
+            silentFrames += frameCount;
+            if (bypass)
+            {
+                stftBypassed = true;
+                return true;
+            }
+            silent = false;
+        }
+        else
+        {
+            if (spectrumLayout != SpectrumLayout::None)
+                ClearSpectra(frameCount);
+            return true;
+        }
+
+        if (spectrumLayout != SpectrumLayout::None)
+        {
+            AnalyzeSpectrum(frameCount);
+            return false;
+        }
+
+        if (stftBypassed)
+        {
+            stft->Reset();
+            compressor.Reset();
+            stftBypassed = false;
+        }
+
+        if (stftConfig)
+        {
+            const int frameSize = stftConfig->frameSize;
+            const int channelCount = static_cast<int>(channels.size());
+            stft->Process(channelPointers.data(), frameCount, [this, frameSize, channelCount](Sample *frames)
+                          { CompressFrames(frames, frameSize, channelCount); });
+        }
+        else
+        {
+            ApplyCompression(frameCount);
+        }
+        return false;
+    }
+
+private:
+    // A decimated packet of frameCount frames comes out one of two sizes,
+    // depending on where the decimator's phase falls, before the cap.
+    void PreparePacketPlans(int frameCount, int frameCap)
+    {
+        const int factor = decimator.Factor();
+        PreparePlan(std::min(frameCap, frameCount / factor));
+        if (factor > 1)
+            PreparePlan(std::min(frameCap, frameCount / factor + 1));
+    }
+
+    void PreparePlan(int size)
+    {
+        if (size <= 0)
+            return;
+
+        if (channelBlocks.empty())
+            planCache.Get(size, static_cast<int>(channels.size()));
+        for (ChannelBlock &block : channelBlocks)
+            block.planCache->Get(size, block.channelCount);
+    }
+
+    // Decimates the first frameCount frames of every channel in place and
+    // trims the channels to at most frameCap of the frames that remain.
+    auto Decimate(size_t frameCount, size_t frameCap) -> size_t
+    {
+        if (decimator.Factor() <= 1)
+            return frameCount;
+
+        STATS_TICKS(decimateStart);
+        frameCount = std::min(frameCap, decimator.Process(channelPointers.data(), frameCount));
+        STATS_RECORD(stats, StatsStage::Decimate, decimateStart);
+        ResizeChannels(frameCount);
+        return frameCount;
+    }
+
+    // Shrinking within the reserved capacity keeps channelPointers valid.
+    void ResizeChannels(size_t frameCount)
+    {
+        for (auto &channel : channels)
+            channel.resize(frameCount);
+    }
+
+    // Keys go in sorted order, as dump() wrote them from its std::map.
+    void WriteJsonPositions(const CapturedPacket &packet)
+    {
+        jsonWriter.Key("devicePosition");
+        jsonWriter.Integer(packet.devicePosition);
+        jsonWriter.Key("discontinuity");
+        jsonWriter.Bool((packet.flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) != 0 || packet.gapFrames > 0);
+        jsonWriter.Key("gapFrames");
+        jsonWriter.Integer(packet.gapFrames);
+    }
+
+    void WriteJsonSilence(const CapturedPacket &packet)
+    {
+        STATS_TICKS(serializeStart);
+        jsonWriter.Clear();
+        jsonWriter.BeginObject();
+        WriteJsonPositions(packet);
+        jsonWriter.Key("qpcPosition");
+        jsonWriter.Integer(packet.qpcPosition);
+        jsonWriter.Key("silence");
+        jsonWriter.Integer(channels[0].size());
+        if (streamId >= 0)
+        {
+            jsonWriter.Key("stream");
+            jsonWriter.Integer(streamId);
+        }
+        jsonWriter.EndObject();
+        jsonWriter.EndLine();
+        STATS_RECORD(stats, StatsStage::Serialize, serializeStart);
+
+        WriteToSink(jsonWriter.Data(), jsonWriter.Size(), true);
+    }
+
+    // leftSamples/rightSamples are the first two channels (mono repeats the
+    // only one); layouts with more channels also carry every channel in order.
+    // Positions and gapFrames mean the same as in BinaryFrameHeader.
+    //
+    // Spectrum records carry leftSpectrum/rightSpectrum and channelSpectra in
+    // the same way, plus the sampleRate and transformSize the values came from.
+    void WriteJson(const CapturedPacket &packet)
+    {
+        const bool spectrum = spectrumLayout != SpectrumLayout::None;
+        const auto &values = spectrum ? spectra : channels;
+        const auto &left = values[0];
+        const auto &right = values.size() > 1 ? values[1] : values[0];
+
+        // Left and right repeat arrays already written, text and all.
+        STATS_TICKS(serializeStart);
+        jsonWriter.Clear();
+        jsonWriter.BeginObject();
+        JsonWriter::Span leftText;
+        JsonWriter::Span rightText;
+        if (values.size() > 2)
+        {
+            jsonWriter.Key(spectrum ? "channelSpectra" : "channels");
+            jsonWriter.BeginArray();
+            leftText = jsonWriter.Numbers(values[0].data(), values[0].size());
+            rightText = jsonWriter.Numbers(values[1].data(), values[1].size());
+            for (size_t channel = 2; channel < values.size(); ++channel)
+                jsonWriter.Numbers(values[channel].data(), values[channel].size());
+            jsonWriter.EndArray();
+        }
+        WriteJsonPositions(packet);
+        jsonWriter.Key(spectrum ? "leftSpectrum" : "leftSamples");
+        if (leftText.size > 0)
+            jsonWriter.Repeat(leftText);
+        else
+            leftText = jsonWriter.Numbers(left.data(), left.size());
+        jsonWriter.Key("qpcPosition");
+        jsonWriter.Integer(packet.qpcPosition);
+        jsonWriter.Key(spectrum ? "rightSpectrum" : "rightSamples");
+        if (rightText.size > 0)
+            jsonWriter.Repeat(rightText);
+        else if (values.size() == 1)
+            jsonWriter.Repeat(leftText);
+        else
+            jsonWriter.Numbers(right.data(), right.size());
+        if (spectrum)
+        {
+            // Whole rates stay integers, as without decimation.
+            jsonWriter.Key("sampleRate");
+            if (processingRate == std::floor(processingRate))
+                jsonWriter.Integer(static_cast<uint32_t>(processingRate));
+            else
+                jsonWriter.Number(static_cast<Sample>(processingRate));
+        }
+        if (streamId >= 0)
+        {
+            jsonWriter.Key("stream");
+            jsonWriter.Integer(streamId);
+        }
+        if (spectrum)
+        {
+            jsonWriter.Key("transformSize");
+            jsonWriter.Integer(channels[0].size());
+        }
+        jsonWriter.EndObject();
+        jsonWriter.EndLine();
+        STATS_RECORD(stats, StatsStage::Serialize, serializeStart);
+
+        WriteToSink(jsonWriter.Data(), jsonWriter.Size(), true);
+    }
+
+    void WriteBinarySilence(const CapturedPacket &packet)
+    {
+        BinaryFrameHeader header = MakeBinaryHeader(packet);
+        header.flags |= BINARY_FLAG_SILENCE;
+        WriteToSink(&header, sizeof(header), false);
+    }
+
+    auto MakeBinaryHeader(const CapturedPacket &packet) -> BinaryFrameHeader
+    {
+        BinaryFrameHeader header{};
+        header.magic = BINARY_FRAME_MAGIC;
+        header.sequence = sequence++;
+        header.qpcPosition = packet.qpcPosition;
+        header.devicePosition = packet.devicePosition;
+        header.streamId = static_cast<uint16_t>(std::max(streamId, 0));
+        header.channelCount = static_cast<uint16_t>(channels.size());
+        header.flags = static_cast<uint16_t>(packet.flags);
+        header.gapFrames = static_cast<uint32_t>(std::min<UINT64>(packet.gapFrames, UINT32_MAX));
+        header.frameCount = static_cast<uint32_t>(channels[0].size());
+        return header;
+    }
+
+    void WriteBinaryFrame(const CapturedPacket &packet)
+    {
+        const bool spectrum = spectrumLayout != SpectrumLayout::None;
+        const auto &values = spectrum ? spectra : channels;
+        const size_t frameCount = values[0].size();
+        const size_t channelCount = values.size();
+
+        STATS_TICKS(serializeStart);
+        BinaryFrameHeader header = MakeBinaryHeader(packet);
+        if (spectrum)
+        {
+            header.flags |= BINARY_FLAG_SPECTRUM;
+            header.frameCount = static_cast<uint32_t>(frameCount);
+        }
+
+        // One contiguous record so the sink can write it in a single call.
+        const size_t headerFloats = (sizeof(header) + sizeof(float) - 1) / sizeof(float);
+        interleaved.resize(headerFloats + frameCount * channelCount);
+        auto *record = reinterpret_cast<BYTE *>(interleaved.data()) + headerFloats * sizeof(float) - sizeof(header);
+        std::memcpy(record, &header, sizeof(header));
+
+        float *samples = interleaved.data() + headerFloats;
+        for (size_t i = 0; i < frameCount; ++i)
+        {
+            for (size_t channel = 0; channel < channelCount; ++channel)
+                samples[i * channelCount + channel] = static_cast<float>(values[channel][i]);
+        }
+
+        STATS_RECORD(stats, StatsStage::Serialize, serializeStart);
+
+        WriteToSink(record, sizeof(header) + frameCount * channelCount * sizeof(float), false);
+    }
+
+    // Packed frames only go out once full, so each flush covers a batch.
+    void WritePacked(const CapturedPacket &packet, bool silenceRecord)
+    {
+        STATS_TICKS(serializeStart);
+        PackedPacketHeader header{};
+        header.qpcPosition = packet.qpcPosition;
+        header.devicePosition = packet.devicePosition;
+        header.flags = static_cast<uint16_t>(packet.flags);
+        header.gapFrames = static_cast<uint32_t>(std::min<UINT64>(packet.gapFrames, UINT32_MAX));
+        header.frameCount = static_cast<uint32_t>(channels[0].size());
+
+        bool full;
+        if (silenceRecord)
+        {
+            header.flags |= BINARY_FLAG_SILENCE;
+            full = packedEncoder.AddSilence(sequence++, header);
+        }
+        else
+        {
+            full = packedEncoder.Add(sequence++, header, channels);
+        }
+        STATS_RECORD(stats, StatsStage::Serialize, serializeStart);
+
+        if (full)
+            WritePackedFrame();
+    }
+
+    void WritePackedFrame()
+    {
+        auto [data, size] = packedEncoder.Finish(static_cast<uint16_t>(std::max(streamId, 0)),
+                                                 static_cast<uint32_t>(std::lround(processingRate)));
+        WriteToSink(data, size, true);
+    }
+
+    void WriteToSink(const void *data, size_t size, bool flush)
+    {
+        STATS_TICKS(writeStart);
+        sink.Write(data, size, flush);
+        STATS_RECORD(stats, StatsStage::Write, writeStart);
+    }
+
+    // Forward transform of the whole packet, reduced to spectrum values per
+    // channel; there is no gain and no inverse transform.
+    void AnalyzeSpectrum(size_t frameCount)
+    {
+        const int N = static_cast<int>(frameCount);
+        if (N == 0)
+        {
+            ClearSpectra(frameCount);
+            return;
+        }
+
+        const int bins = N / 2 + 1;
+        spectrumAnalyzer.Prepare(bins, N, processingRate);
+        for (auto &spectrum : spectra)
+            spectrum.resize(spectrumAnalyzer.ValueCount(bins));
+
+        ForEachChannelBlock(
+            [this, N](FFTPlanCache &cache, FFTWorkspace &blockWorkspace, int firstChannel, int channelCount)
+            {
+                FFTPlanCache::Plan &plan = cache.Get(N, channelCount);
+                for (int block = 0; block < channelCount; ++block)
+                    std::copy(channels[firstChannel + block].begin(), channels[firstChannel + block].end(),
+                              blockWorkspace.samples + static_cast<size_t>(block) * N);
+
+                STATS_TICKS(forwardStart);
+                FFTW::ExecuteR2C(plan.forward, blockWorkspace.samples, blockWorkspace.spectrum);
+                STATS_RECORD(stats, StatsStage::Fft, forwardStart);
+
+                for (int block = 0; block < channelCount; ++block)
+                    spectrumAnalyzer.Analyze(blockWorkspace.spectrum + static_cast<size_t>(block) * plan.bins,
+                                             spectra[firstChannel + block].data());
+            });
+    }
+
+    // The spectrum of a silent packet, without running the transform.
+    void ClearSpectra(size_t frameCount)
+    {
+        size_t valueCount = frameCount > 0 ? spectrumAnalyzer.ValueCount(static_cast<int>(frameCount / 2 + 1)) : 0;
+        for (auto &spectrum : spectra)
+            spectrum.assign(valueCount, Sample(0));
+    }
+
+    // Compresses every channel of the packet.
+    void ApplyCompression(size_t frameCount)
+    {
+        const int N = static_cast<int>(frameCount);
+        if (N == 0)
+            return;
+
+        CompressChannels(channelPointers.data(), N);
+    }
+
+    // frames holds channelCount frames of N samples back to back.
+    void CompressFrames(Sample *frames, int N, int channelCount)
+    {
+        for (int channel = 0; channel < channelCount; ++channel)
+            framePointers[channel] = frames + static_cast<size_t>(channel) * N;
+
+        CompressChannels(framePointers.data(), N);
+    }
+
+    // Compresses N samples of every channel in place, one batched transform
+    // per channel block.
+    void CompressChannels(Sample *const *channelData, int N)
+    {
+        // Successive STFT frames are a hop apart, successive packets a packet.
+        const double frameSeconds = (stftConfig ? stftConfig->hop : N) / processingRate;
+        compressor.Prepare(N / 2 + 1, static_cast<int>(channels.size()), N, processingRate, frameSeconds);
+
+        ForEachChannelBlock([this, channelData, N](FFTPlanCache &cache, FFTWorkspace &blockWorkspace, int firstChannel, int channelCount)
+                            { CompressBlock(cache, blockWorkspace, channelData, N, firstChannel, channelCount); });
+    }
+
+    // Runs the forward transform, gain and inverse transform for channels
+    // [firstChannel, firstChannel + channelCount) and writes the normalized
+    // result back to channelData.
+    void CompressBlock(FFTPlanCache &cache, FFTWorkspace &blockWorkspace, Sample *const *channelData, int N, int firstChannel,
+                       int channelCount)
+    {
+        FFTPlanCache::Plan &plan = cache.Get(N, channelCount);
+        Sample *samples = blockWorkspace.samples;
+        FFTW::Complex *spectrum = blockWorkspace.spectrum;
+
+        for (int block = 0; block < channelCount; ++block)
+            std::copy(channelData[firstChannel + block], channelData[firstChannel + block] + N, samples + static_cast<size_t>(block) * N);
+
+        STATS_TICKS(forwardStart);
+        FFTW::ExecuteR2C(plan.forward, samples, spectrum);
+        STATS_RECORD(stats, StatsStage::Fft, forwardStart);
+
+        STATS_TICKS(gainStart);
+        compressor.Apply(reinterpret_cast<Sample *>(spectrum), firstChannel, channelCount);
+        STATS_RECORD(stats, StatsStage::Gain, gainStart);
+
+        STATS_TICKS(inverseStart);
+        FFTW::ExecuteC2R(plan.inverse, spectrum, samples);
+        STATS_RECORD(stats, StatsStage::Fft, inverseStart);
+
+        const Sample scale = Sample(1) / N;
+        for (int block = 0; block < channelCount; ++block)
+        {
+            const Sample *source = samples + static_cast<size_t>(block) * N;
+            Sample *destination = channelData[firstChannel + block];
+            for (int i = 0; i < N; ++i)
+                destination[i] = source[i] * scale;
+        }
+    }
+
+    // Calls work(planCache, workspace, firstChannel, channelCount) for every
+    // channel block and returns once all are done. Without workers there is
+    // one block on this thread's shared cache; with them, each block keeps its
+    // own plan cache and workspace, and the split depends only on the channel
+    // count, so output never depends on scheduling.
+    template <typename Work>
+    void ForEachChannelBlock(Work &&work)
+    {
+        if (channelBlocks.empty())
+        {
+            work(planCache, *workspace, 0, static_cast<int>(channels.size()));
+            return;
+        }
+
+        auto task = [this, &work](int index)
+        {
+            ChannelBlock &block = channelBlocks[index];
+            work(*block.planCache, *block.workspace, block.firstChannel, block.channelCount);
+        };
+        workerPool->Run(static_cast<int>(channelBlocks.size()), task);
+    }
+
+    struct ChannelBlock
+    {
+        int firstChannel;
+        int channelCount;
+        std::unique_ptr<FFTPlanCache> planCache;
+        std::unique_ptr<FFTWorkspace> workspace;
+    };
+
+    SimdKernels kernels;
+    Decimator decimator;
+    SpectralCompressor compressor;
+    DeinterleaveFn deinterleave = nullptr;
+    OutputFormat format;
+    SilenceOutput silenceOutput;
+    Sample noiseFloor;
+    SpectrumLayout spectrumLayout;
+    SpectrumAnalyzer spectrumAnalyzer;
+    PackedEncoder packedEncoder;
+    size_t silentFrames = 0;
+    bool stftBypassed = false;
+    int outputRate;
+    int packedBatch;
+    double processingRate = 0.0; // sample rate after decimation
+    unsigned plannerFlags;
+    FFTPlanCache &planCache;
+    OutputSink &sink;
+    int streamId;
+    StreamFormat streamFormat{};
+    std::unique_ptr<FFTWorkspace> workspace;
+    std::vector<std::vector<Sample>> channels;
+    std::vector<Sample *> channelPointers;
+    std::vector<Sample *> framePointers;
+    std::unique_ptr<WorkerPool> workerPool;
+    std::vector<ChannelBlock> channelBlocks;
+    std::vector<float> interleaved;
+    std::vector<std::vector<Sample>> spectra;
+    std::unique_ptr<StftConfig> stftConfig;
+    std::unique_ptr<StftProcessor> stft;
+    JsonWriter jsonWriter;
+    uint64_t sequence = 0;
+#ifdef GETDESKTOPAUDIO_STATS
+    StreamStats *stats = nullptr;
+#endif
+};
@@ -0,0 +1,172 @@
+﻿#pragma once
+
+// Per-stage latency histograms and throughput counters for the capture and
+// processing paths. All of it exists only in builds with GETDESKTOPAUDIO_STATS;
+// otherwise the STATS_* macros expand to nothing and the hot path is unchanged.
+
+#ifdef GETDESKTOPAUDIO_STATS
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#define NOMINMAX
+#include <windows.h>
+#undef NOMINMAX
+
+enum class StatsStage
+{
+    CaptureWait,
+    GetBuffer,
+    Deinterleave,
+    Decimate,
+    Fft,
+    Gain,
+    Serialize,
+    Write,
+    Count
+};
+
+constexpr const char *STATS_STAGE_NAMES[] = {"wait", "getbuffer", "deinterleave", "decimate", "fft", "gain", "serialize", "write"};
+
+inline auto StatsNow() -> int64_t
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+// Log-linear buckets in the style of an HDR histogram: 16 linear sub-buckets
+// per power of two, so a recorded value is off by at most 1/16 and recording
+// costs a bit scan and one relaxed increment. Values are QPC ticks.
+class LatencyHistogram
+{
+public:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    using Snapshot = std::array<uint64_t, BUCKET_COUNT>;
+
+    void Record(int64_t ticks)
+    {
+        counts[IndexOf(ticks > 0 ? static_cast<uint64_t>(ticks) : 0)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Moves every count into snapshot and clears it, so each report covers
+    // only the interval since the last one. Returns the number of samples.
+    auto Drain(Snapshot &snapshot) -> uint64_t
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKET_COUNT; ++i)
+        {
+            snapshot[i] = counts[i].exchange(0, std::memory_order_relaxed);
+            total += snapshot[i];
+        }
+        return total;
+    }
+
+    // The middle of the bucket holding the value at quantile.
+    static auto ValueAt(const Snapshot &snapshot, uint64_t total, double quantile) -> uint64_t
+    {
+        uint64_t rank = static_cast<uint64_t>(quantile * (total - 1));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; ++i)
+        {
+            seen += snapshot[i];
+            if (seen > rank)
+                return LowestOf(i) + WidthOf(i) / 2;
+        }
+        return 0;
+    }
+
+    static auto Max(const Snapshot &snapshot) -> uint64_t
+    {
+        for (int i = BUCKET_COUNT - 1; i >= 0; --i)
+        {
+            if (snapshot[i] != 0)
+                return LowestOf(i) + WidthOf(i) - 1;
+        }
+        return 0;
+    }
+
+private:
+    static auto IndexOf(uint64_t value) -> int
+    {
+        if (value < SUB_BUCKETS)
+            return static_cast<int>(value);
+        int shift = 63 - std::countl_zero(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static auto LowestOf(int index) -> uint64_t
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+        int shift = index / SUB_BUCKETS - 1;
+        return static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    }
+
+    static auto WidthOf(int index) -> uint64_t
+    {
+        return index < SUB_BUCKETS ? 1 : uint64_t(1) << (index / SUB_BUCKETS - 1);
+    }
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> counts{};
+};
+
+// Everything one stream records. Stages are written by the capture and
+// processing threads and drained by the reporter.
+struct StreamStats
+{
+    void Record(StatsStage stage, int64_t ticks) { histograms[static_cast<size_t>(stage)].Record(ticks); }
+
+    std::array<LatencyHistogram, static_cast<size_t>(StatsStage::Count)> histograms;
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> frames{0};
+};
+
+// Appends one line per stage that saw samples since the last report.
+inline void FormatStageStats(StreamStats &stats, std::string &report)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const double microsecondsPerTick = 1e6 / static_cast<double>(frequency.QuadPart);
+
+    LatencyHistogram::Snapshot snapshot;
+    for (size_t stage = 0; stage < stats.histograms.size(); ++stage)
+    {
+        uint64_t total = stats.histograms[stage].Drain(snapshot);
+        if (total == 0)
+            continue;
+
+        char line[160];
+        std::snprintf(line, sizeof(line), "  %-12s n %8llu  p50 %9.1f  p99 %9.1f  p999 %9.1f  max %9.1f us\n", STATS_STAGE_NAMES[stage],
+                      static_cast<unsigned long long>(total),
+                      LatencyHistogram::ValueAt(snapshot, total, 0.50) * microsecondsPerTick,
+                      LatencyHistogram::ValueAt(snapshot, total, 0.99) * microsecondsPerTick,
+                      LatencyHistogram::ValueAt(snapshot, total, 0.999) * microsecondsPerTick,
+                      LatencyHistogram::Max(snapshot) * microsecondsPerTick);
+        report += line;
+    }
+}
+
+// STATS_TICKS(name) marks the start of a stage; STATS_RECORD records the time
+// since that mark when stats is non-null.
+#define STATS_TICKS(name) const int64_t name = StatsNow()
+#define STATS_RECORD(stats, stage, start)                   \
+    do                                                      \
+    {                                                       \
+        if (stats)                                          \
+            (stats)->Record((stage), StatsNow() - (start)); \
+    } while (0)
+
+#else
+
+#define STATS_TICKS(name)
+#define STATS_RECORD(stats, stage, start)
+
+#endif
@@ -0,0 +1,612 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define NOMINMAX
+#include <windows.h>
+#undef NOMINMAX
+
+#include "processor.h"
+
+// Output sinks for consumers on the same machine. Both carry the records of
+// the selected -format unchanged; with binary frames a consumer reads samples
+// straight out of the transport without parsing text.
+
+// Layout of a -output shm:<name> mapping: this header, then capacity bytes of
+// ring. Each record is a uint32 byte count followed by one record of output,
+// padded to 8 bytes; a record may wrap past the end of the ring.
+//
+// One process writes and never waits for readers, so a reader that falls more
+// than capacity behind is overwritten. writeSequence is a sequence lock over
+// the header: odd while the writer is busy. Before copying a record the writer
+// publishes its end in reserved, so every byte up to capacity before reserved
+// may be changing. A reader keeps its own position and reads the records
+// before head (loaded with acquire). After copying a record out it issues an
+// acquire fence and checks that reserved is still at most capacity past the
+// start of the record; if not, the copy may be torn, the reader lost data and
+// it restarts at newestRecord. SharedRingReader does exactly this. The
+// auto-reset event <name>-data is set after every record.
+struct SharedRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    std::atomic<uint64_t> writeSequence;
+    std::atomic<uint64_t> head;         // bytes ever written, the end of the newest record
+    std::atomic<uint64_t> reserved;     // the end of the record being written, or head between records
+    std::atomic<uint64_t> newestRecord; // where the newest record starts
+    std::atomic<uint64_t> recordCount;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The shared ring needs lock-free 64-bit atomics.");
+
+constexpr uint32_t SHARED_RING_MAGIC = 0x52414447; // "GDAR"
+constexpr uint32_t SHARED_RING_VERSION = 2;
+
+// Holds a few seconds of eight-channel JSON, far more of binary frames.
+constexpr uint64_t SHARED_RING_CAPACITY = 1ull << 24;
+
+constexpr uint64_t SHARED_RECORD_ALIGNMENT = 8;
+
+class SharedMemorySink : public OutputSink
+{
+public:
+    // capacity must be a multiple of SHARED_RECORD_ALIGNMENT.
+    explicit SharedMemorySink(const std::wstring &name, uint64_t capacity = SHARED_RING_CAPACITY) : capacity(capacity)
+    {
+        const uint64_t mappingSize = sizeof(SharedRingHeader) + capacity;
+        mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(mappingSize >> 32),
+                                     static_cast<DWORD>(mappingSize), name.c_str());
+        if (!mapping)
+        {
+            throw std::runtime_error("Failed to create shared memory mapping.");
+        }
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            CloseHandle(mapping);
+            throw std::runtime_error("Shared memory name is already in use.");
+        }
+
+        void *view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (!view)
+        {
+            CloseHandle(mapping);
+            throw std::runtime_error("Failed to map shared memory.");
+        }
+
+        dataEvent = CreateEventW(nullptr, FALSE, FALSE, (name + L"-data").c_str());
+        if (!dataEvent)
+        {
+            UnmapViewOfFile(view);
+            CloseHandle(mapping);
+            throw std::runtime_error("Failed to create shared memory event.");
+        }
+
+        header = new (view) SharedRingHeader();
+        header->magic = SHARED_RING_MAGIC;
+        header->version = SHARED_RING_VERSION;
+        header->capacity = capacity;
+        ring = static_cast<BYTE *>(view) + sizeof(SharedRingHeader);
+    }
+
+    SharedMemorySink(const SharedMemorySink &) = delete;
+    SharedMemorySink &operator=(const SharedMemorySink &) = delete;
+
+    ~SharedMemorySink() override
+    {
+        CloseHandle(dataEvent);
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+    }
+
+    void Write(const void *data, size_t size, bool) override
+    {
+        const uint64_t recordSize = (sizeof(uint32_t) + size + SHARED_RECORD_ALIGNMENT - 1) & ~(SHARED_RECORD_ALIGNMENT - 1);
+        if (recordSize > capacity)
+        {
+            throw std::runtime_error("Record does not fit the shared memory ring.");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const uint64_t start = header->head.load(std::memory_order_relaxed);
+            const uint64_t sequence = header->writeSequence.load(std::memory_order_relaxed);
+
+            header->writeSequence.store(sequence + 1, std::memory_order_relaxed);
+            // A reader that sees any byte of this record in place of an older
+            // one also sees the reservation covering it.
+            header->reserved.store(start + recordSize, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            // Records start 8-aligned, so the count itself never wraps.
+            const uint32_t length = static_cast<uint32_t>(size);
+            std::memcpy(ring + start % capacity, &length, sizeof(length));
+            CopyIn(start + sizeof(length), data, size);
+
+            header->newestRecord.store(start, std::memory_order_relaxed);
+            header->head.store(start + recordSize, std::memory_order_release);
+            header->recordCount.store(header->recordCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            header->writeSequence.store(sequence + 2, std::memory_order_release);
+        }
+        SetEvent(dataEvent);
+    }
+
+private:
+    void CopyIn(uint64_t position, const void *data, size_t size)
+    {
+        const size_t offset = static_cast<size_t>(position % capacity);
+        const size_t first = std::min<size_t>(size, static_cast<size_t>(capacity - offset));
+        std::memcpy(ring + offset, data, first);
+        std::memcpy(ring, static_cast<const BYTE *>(data) + first, size - first);
+    }
+
+    const uint64_t capacity;
+    HANDLE mapping = nullptr;
+    HANDLE dataEvent = nullptr;
+    SharedRingHeader *header = nullptr;
+    BYTE *ring = nullptr;
+    std::mutex mutex;
+};
+
+// The reader side of the protocol above, for consumers and for checking the
+// writer. It starts at the newest record and copies each record out, so what
+// Read returns is never torn.
+class SharedRingReader
+{
+public:
+    enum class Result
+    {
+        Record,
+        Empty,
+        Lost // records were overwritten before they were read; reading goes on from the newest one
+    };
+
+    explicit SharedRingReader(const std::wstring &name)
+    {
+        mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name.c_str());
+        if (!mapping)
+        {
+            throw std::runtime_error("Failed to open shared memory mapping.");
+        }
+
+        void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view)
+        {
+            CloseHandle(mapping);
+            throw std::runtime_error("Failed to map shared memory.");
+        }
+        header = static_cast<const SharedRingHeader *>(view);
+        ring = static_cast<const BYTE *>(view) + sizeof(SharedRingHeader);
+        if (header->magic != SHARED_RING_MAGIC || header->version != SHARED_RING_VERSION)
+        {
+            UnmapViewOfFile(view);
+            CloseHandle(mapping);
+            throw std::runtime_error("Shared memory is not an output ring of this version.");
+        }
+        capacity = header->capacity;
+
+        dataEvent = OpenEventW(SYNCHRONIZE, FALSE, (name + L"-data").c_str());
+        if (!dataEvent)
+        {
+            UnmapViewOfFile(view);
+            CloseHandle(mapping);
+            throw std::runtime_error("Failed to open shared memory event.");
+        }
+
+        position = NewestRecord();
+    }
+
+    SharedRingReader(const SharedRingReader &) = delete;
+    SharedRingReader &operator=(const SharedRingReader &) = delete;
+
+    ~SharedRingReader()
+    {
+        CloseHandle(dataEvent);
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+    }
+
+    // Waits up to timeout milliseconds for the writer to add a record.
+    auto Wait(DWORD timeout) -> bool { return WaitForSingleObject(dataEvent, timeout) == WAIT_OBJECT_0; }
+
+    // Copies the next record into record.
+    auto Read(std::vector<BYTE> &record) -> Result
+    {
+        const uint64_t head = header->head.load(std::memory_order_acquire);
+        if (position == head)
+            return Result::Empty;
+        if (head - position > capacity)
+            return Restart();
+
+        uint32_t length = 0;
+        std::memcpy(&length, ring + position % capacity, sizeof(length));
+        const uint64_t recordSize = (sizeof(length) + static_cast<uint64_t>(length) + SHARED_RECORD_ALIGNMENT - 1) & ~(SHARED_RECORD_ALIGNMENT - 1);
+        if (recordSize > head - position)
+        {
+            // Only an overwritten count can point past head.
+            return Restart();
+        }
+        record.resize(length);
+        CopyOut(position + sizeof(length), record.data(), length);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->reserved.load(std::memory_order_relaxed) - position > capacity)
+            return Restart();
+
+        position += recordSize;
+        return Result::Record;
+    }
+
+private:
+    // newestRecord as of a moment the writer was between records.
+    auto NewestRecord() const -> uint64_t
+    {
+        while (true)
+        {
+            const uint64_t sequence = header->writeSequence.load(std::memory_order_acquire);
+            const uint64_t newest = header->newestRecord.load(std::memory_order_relaxed);
+            const uint64_t head = header->head.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence % 2 == 0 && header->writeSequence.load(std::memory_order_relaxed) == sequence)
+                return header->recordCount.load(std::memory_order_relaxed) == 0 ? head : newest;
+            std::this_thread::yield();
+        }
+    }
+
+    auto Restart() -> Result
+    {
+        position = NewestRecord();
+        return Result::Lost;
+    }
+
+    void CopyOut(uint64_t from, BYTE *data, size_t size) const
+    {
+        const size_t offset = static_cast<size_t>(from % capacity);
+        const size_t first = std::min<size_t>(size, static_cast<size_t>(capacity - offset));
+        std::memcpy(data, ring + offset, first);
+        std::memcpy(data + first, ring, size - first);
+    }
+
+    HANDLE mapping = nullptr;
+    HANDLE dataEvent = nullptr;
+    const SharedRingHeader *header = nullptr;
+    const BYTE *ring = nullptr;
+    uint64_t capacity = 0;
+    uint64_t position = 0;
+};
+
+constexpr DWORD PIPE_BUFFER_SIZE = 1 << 16;
+
+// Output queued behind a slow client before Write waits for it.
+constexpr size_t PIPE_PENDING_LIMIT = 1 << 22;
+
+// Serves -output pipe:<name> as \\.\pipe\<name> to one local client at a
+// time. Writes are overlapped and double-buffered, so a record only waits for
+// the client once PIPE_PENDING_LIMIT bytes are queued. Output before a client
+// connects, or after it disconnects, is dropped; the pipe then listens again.
+class PipeSink : public OutputSink
+{
+public:
+    explicit PipeSink(const std::wstring &name)
+    {
+        const std::wstring path = L"\\\\.\\pipe\\" + name;
+        pipe = CreateNamedPipeW(path.c_str(), PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, PIPE_BUFFER_SIZE, 0, 0, nullptr);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            throw std::runtime_error("Failed to create named pipe.");
+        }
+
+        connectOverlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        writeOverlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!connectOverlapped.hEvent || !writeOverlapped.hEvent)
+        {
+            CloseHandles();
+            throw std::runtime_error("Failed to create pipe events.");
+        }
+
+        pending.reserve(PIPE_PENDING_LIMIT);
+        inFlight.reserve(PIPE_PENDING_LIMIT);
+
+        try
+        {
+            BeginConnect();
+        }
+        catch (...)
+        {
+            CloseHandles();
+            throw;
+        }
+    }
+
+    PipeSink(const PipeSink &) = delete;
+    PipeSink &operator=(const PipeSink &) = delete;
+
+    // Hands the client everything still queued. Closing without
+    // DisconnectNamedPipe lets it read what is left in the pipe buffer.
+    ~PipeSink() override
+    {
+        try
+        {
+            if (writing)
+                CompleteWrite(true);
+            if (connected && !pending.empty())
+            {
+                StartWrite();
+                if (writing)
+                    CompleteWrite(true);
+            }
+        }
+        catch (const std::runtime_error &)
+        {
+            // The client left and listening again failed; nothing is owed.
+        }
+        if (connecting)
+        {
+            DWORD transferred = 0;
+            CancelIoEx(pipe, &connectOverlapped);
+            GetOverlappedResult(pipe, &connectOverlapped, &transferred, TRUE);
+        }
+        CloseHandles();
+    }
+
+    void Write(const void *data, size_t size, bool) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!IsConnected())
+            return;
+
+        const auto *bytes = static_cast<const BYTE *>(data);
+        if (writing && !CompleteWrite(pending.size() + size > PIPE_PENDING_LIMIT))
+        {
+            pending.insert(pending.end(), bytes, bytes + size);
+            return;
+        }
+        if (!connected)
+            return;
+
+        pending.insert(pending.end(), bytes, bytes + size);
+        StartWrite();
+    }
+
+private:
+    void BeginConnect()
+    {
+        ResetEvent(connectOverlapped.hEvent);
+        if (ConnectNamedPipe(pipe, &connectOverlapped))
+        {
+            connected = true;
+            return;
+        }
+
+        DWORD error = GetLastError();
+        if (error == ERROR_PIPE_CONNECTED)
+            connected = true;
+        else if (error == ERROR_IO_PENDING)
+            connecting = true;
+        else
+            throw std::runtime_error("Failed to listen on named pipe.");
+    }
+
+    auto IsConnected() -> bool
+    {
+        if (connecting && HasOverlappedIoCompleted(&connectOverlapped))
+        {
+            DWORD transferred = 0;
+            connecting = false;
+            if (GetOverlappedResult(pipe, &connectOverlapped, &transferred, FALSE))
+                connected = true;
+            else
+                BeginConnect();
+        }
+        return connected;
+    }
+
+    void StartWrite()
+    {
+        std::swap(pending, inFlight);
+        pending.clear();
+
+        ResetEvent(writeOverlapped.hEvent);
+        if (!WriteFile(pipe, inFlight.data(), static_cast<DWORD>(inFlight.size()), nullptr, &writeOverlapped) &&
+            GetLastError() != ERROR_IO_PENDING)
+        {
+            Disconnect();
+            return;
+        }
+        writing = true;
+    }
+
+    // Returns true once the write in flight is done, whether it succeeded or
+    // the client went away; false if it is still running and wait is false.
+    auto CompleteWrite(bool wait) -> bool
+    {
+        DWORD transferred = 0;
+        if (!GetOverlappedResult(pipe, &writeOverlapped, &transferred, wait))
+        {
+            if (GetLastError() == ERROR_IO_INCOMPLETE)
+                return false;
+            writing = false;
+            Disconnect();
+            return true;
+        }
+        writing = false;
+        return true;
+    }
+
+    void Disconnect()
+    {
+        DisconnectNamedPipe(pipe);
+        connected = false;
+        pending.clear();
+        BeginConnect();
+    }
+
+    void CloseHandles()
+    {
+        if (writeOverlapped.hEvent)
+            CloseHandle(writeOverlapped.hEvent);
+        if (connectOverlapped.hEvent)
+            CloseHandle(connectOverlapped.hEvent);
+        CloseHandle(pipe);
+    }
+
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    OVERLAPPED connectOverlapped{};
+    OVERLAPPED writeOverlapped{};
+    std::vector<BYTE> pending;
+    std::vector<BYTE> inFlight;
+    bool connected = false;
+    bool connecting = false;
+    bool writing = false;
+    std::mutex mutex;
+};
+
+// Output gathered before a batch is written early, whatever the window.
+constexpr size_t BATCH_CAPACITY = 1 << 20;
+
+// Coalesces the records of every stream for -batch-ms: a batch is written
+// to the next sink in one call, and flushed, once the window has passed since
+// its first record or it would outgrow BATCH_CAPACITY. The window caps the
+// latency a record gains. A batch is a plain concatenation of records, so on
+// shm: one ring record then holds several.
+class BatchingSink : public OutputSink
+{
+public:
+    BatchingSink(std::unique_ptr<OutputSink> next, int windowMs) : next(std::move(next)), window(windowMs)
+    {
+        pending.reserve(BATCH_CAPACITY);
+        writing.reserve(BATCH_CAPACITY);
+        flusher = std::thread([this]()
+                              { FlushLoop(); });
+    }
+
+    BatchingSink(const BatchingSink &) = delete;
+    BatchingSink &operator=(const BatchingSink &) = delete;
+
+    // Writes out the last batch, before the next sink goes away.
+    ~BatchingSink() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+
+        try
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            WriteBatch(lock);
+        }
+        catch (const std::runtime_error &)
+        {
+            // Nothing is left to report a failed last write to.
+        }
+    }
+
+    // Rethrows a failure of an earlier batch written by the flusher.
+    void Write(const void *data, size_t size, bool) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (error)
+            std::rethrow_exception(std::exchange(error, nullptr));
+
+        while (!pending.empty() && pending.size() + size > BATCH_CAPACITY)
+        {
+            WriteBatch(lock);
+            lock.lock();
+        }
+        if (size > BATCH_CAPACITY)
+        {
+            // Too large to batch, so it goes out on its own, still in order.
+            std::lock_guard<std::mutex> writeLock(writeMutex);
+            lock.unlock();
+            next->Write(data, size, true);
+            return;
+        }
+
+        const bool first = pending.empty();
+        const auto *bytes = static_cast<const BYTE *>(data);
+        pending.insert(pending.end(), bytes, bytes + size);
+        if (first)
+        {
+            deadline = std::chrono::steady_clock::now() + window;
+            lock.unlock();
+            wake.notify_one();
+        }
+    }
+
+private:
+    void FlushLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            if (pending.empty())
+            {
+                wake.wait(lock);
+            }
+            else if (std::chrono::steady_clock::now() < deadline)
+            {
+                wake.wait_until(lock, deadline);
+            }
+            else
+            {
+                try
+                {
+                    WriteBatch(lock);
+                }
+                catch (const std::runtime_error &)
+                {
+                    lock.lock();
+                    error = std::current_exception();
+                    continue;
+                }
+                lock.lock();
+            }
+        }
+    }
+
+    // Hands pending to the next sink; returns with lock released. writeMutex
+    // is taken before lock is dropped, so batches go out in order.
+    void WriteBatch(std::unique_lock<std::mutex> &lock)
+    {
+        if (pending.empty())
+        {
+            lock.unlock();
+            return;
+        }
+
+        std::lock_guard<std::mutex> writeLock(writeMutex);
+        std::swap(pending, writing);
+        pending.clear();
+        lock.unlock();
+        next->Write(writing.data(), writing.size(), true);
+    }
+
+    std::unique_ptr<OutputSink> next;
+    std::chrono::milliseconds window;
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<BYTE> pending;
+    std::vector<BYTE> writing;
+    std::exception_ptr error;
+    bool stopping = false;
+    std::mutex mutex;
+    std::mutex writeMutex;
+    std::condition_variable wake;
+    std::thread flusher;
+};
@@ -0,0 +1,164 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define NOMINMAX
+#include <windows.h>
+#undef NOMINMAX
+
+// Persistent threads that run the tasks of one job at a time. The thread
+// calling Run takes part, so a pool of n threads runs up to n + 1 tasks at
+// once. Run does not allocate, so the processing path stays allocation-free.
+class WorkerPool
+{
+public:
+    // Thread i is pinned to cpus[i % cpus.size()], which must be below 64;
+    // an empty list leaves placement to the scheduler.
+    WorkerPool(int threadCount, const std::vector<int> &cpus)
+    {
+        threads.reserve(threadCount);
+        try
+        {
+            for (int i = 0; i < threadCount; ++i)
+            {
+                DWORD_PTR affinity = cpus.empty() ? 0 : DWORD_PTR(1) << cpus[i % cpus.size()];
+                threads.emplace_back([this, affinity]()
+                                     {
+                    if (affinity)
+                        SetThreadAffinityMask(GetCurrentThread(), affinity);
+                    WorkerLoop(); });
+            }
+        }
+        catch (...)
+        {
+            Stop();
+            throw;
+        }
+    }
+
+    ~WorkerPool() { Stop(); }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    auto Size() const -> int { return static_cast<int>(threads.size()) + 1; }
+
+    // Calls task(index) once for every index below taskCount and returns when
+    // all calls have; the first exception a task throws is rethrown here.
+    template <typename Task>
+    void Run(int taskCount, Task &task)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // Workers still leaving the previous job must not claim from this one.
+        idle.wait(lock, [this]()
+                  { return active == 0; });
+
+        current = {&task, &Invoke<Task>, taskCount};
+        nextTask.store(0, std::memory_order_relaxed);
+        remaining.store(taskCount, std::memory_order_relaxed);
+        error = nullptr;
+        ++generation;
+        lock.unlock();
+        wake.notify_all();
+
+        RunTasks(current);
+
+        lock.lock();
+        idle.wait(lock, [this]()
+                  { return remaining.load(std::memory_order_acquire) == 0 && active == 0; });
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct Job
+    {
+        void *task = nullptr;
+        void (*invoke)(void *, int) = nullptr;
+        int taskCount = 0;
+    };
+
+    template <typename Task>
+    static void Invoke(void *task, int index)
+    {
+        (*static_cast<Task *>(task))(index);
+    }
+
+    void RunTasks(const Job &job)
+    {
+        int index;
+        while ((index = nextTask.fetch_add(1, std::memory_order_relaxed)) < job.taskCount)
+        {
+            try
+            {
+                job.invoke(job.task, index);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                idle.notify_all();
+            }
+        }
+    }
+
+    void WorkerLoop()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]()
+                      { return stopping || generation != seen; });
+            if (stopping)
+                return;
+
+            seen = generation;
+            Job job = current;
+            ++active;
+            lock.unlock();
+
+            RunTasks(job);
+
+            lock.lock();
+            if (--active == 0)
+                idle.notify_all();
+        }
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+        threads.clear();
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    Job current;
+    std::atomic<int> nextTask{0};
+    std::atomic<int> remaining{0};
+    std::exception_ptr error;
+    uint64_t generation = 0;
+    int active = 0;
+    bool stopping = false;
+};